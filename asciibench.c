@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark, which times each netascii translation kernel the processor supports against memcpy() and checks that they all agree, reporting as JSON.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftp_ascii.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static long long micros(void);
+static double rate(size_t, long long);
+static size_t decpieces(const struct asciikernel *, const uint8_t *, size_t, uint8_t *, size_t, bool);
+
+// Generates text, translates it both ways with each kernel, and reports how fast each went.
+// Accepts: command-line arguments
+// Returns: exit status, which is nonzero if any kernel got a translation wrong
+int main(int argc, char **argv)
+{
+	// Parse command-line flags:
+	size_t size = 1<<20;
+	unsigned linelen = 64;
+	size_t piece = DATA_LEN;
+	unsigned reps = 200;
+	int flag;
+	while((flag = getopt(argc, argv, "s:l:b:r:")) != -1)
+	{
+		if(flag == 's')
+			size = strtoull(optarg, NULL, 0);
+		else if(flag == 'l')
+			linelen = atoi(optarg);
+		else if(flag == 'b')
+			piece = atoi(optarg);
+		else if(flag == 'r')
+			reps = atoi(optarg);
+		else
+			optind = argc+1;
+	}
+	if(optind != argc || !size || !piece || !reps)
+	{
+		fprintf(stderr, "USAGE: %s [-s text size] [-l line length, or 0 for none] [-b bytes decoded at a time] [-r repetitions]\n", argv[0]);
+		return 1;
+	}
+
+	// Printable characters in lines of the given length, with the odd bare CR thrown in:
+	uint8_t *text = malloc(size);
+	uint8_t *copy = malloc(size+1);
+	uint8_t *enc = malloc(2*size);
+	uint8_t *ref = malloc(2*size);
+	if(!text || !copy || !enc || !ref)
+	{
+		perror("malloc()");
+		return 1;
+	}
+	srand(1);
+	size_t each;
+	for(each = 0; each < size; ++each)
+		if(linelen && each%linelen == linelen-1)
+			text[each] = '\n';
+		else
+			text[each] = rand()%997 ? ' '+rand()%95 : '\r';
+
+	// Time many repetitions together, since each may be quicker than the clock can tell:
+	unsigned rep;
+	long long began = micros();
+	for(rep = 0; rep < reps; ++rep)
+	{
+		memcpy(copy, text, size);
+		__asm__ volatile("" : : "r"(copy) : "memory");
+	}
+	double memcpyrate = rate((size_t)reps*size, micros()-began);
+	printf("{\"text_size\":%zu,\"line_length\":%u,\"decode_piece\":%zu,\"memcpy_mib_per_sec\":%.1f,\"kernels\":[", size, linelen, piece, memcpyrate);
+
+	// The last kernel is the plainest, which the others must match:
+	const struct asciikernel *kernels = asciikernels();
+	const struct asciikernel *plain;
+	for(plain = kernels; plain[1].name; ++plain);
+	size_t reflen = plain->enc(text, size, ref);
+
+	bool wrong = 0;
+	const struct asciikernel *k;
+	for(k = kernels; k->name; ++k)
+	{
+		size_t enclen = 0;
+		size_t declen = 0;
+		began = micros();
+		for(rep = 0; rep < reps; ++rep)
+			enclen = k->enc(text, size, enc);
+		long long enctime = micros()-began;
+
+		began = micros();
+		for(rep = 0; rep < reps; ++rep)
+			declen = decpieces(k, enc, enclen, copy, piece, 0);
+		long long dectime = micros()-began;
+		bool right = enclen == reflen && !memcmp(enc, ref, enclen) && declen == size && !memcmp(copy, text, size);
+
+		// Make sure that splitting pairs of characters between pieces doesn't matter:
+		memset(copy, 0, size);
+		if(right && (decpieces(k, enc, enclen, copy, piece, 1) != size || memcmp(copy, text, size)))
+			right = 0;
+		wrong |= !right;
+
+		double encrate = rate((size_t)reps*size, enctime);
+		double decrate = rate((size_t)reps*enclen, dectime);
+		printf("%s{\"name\":\"%s\",\"correct\":%s,\"encode_mib_per_sec\":%.1f,\"encode_vs_memcpy\":%.2f,\"decode_mib_per_sec\":%.1f,\"decode_vs_memcpy\":%.2f}",
+				k == kernels ? "" : ",", k->name, right ? "true" : "false", encrate, encrate/memcpyrate, decrate, decrate/memcpyrate);
+	}
+	printf("]}\n");
+
+	free(text);
+	free(copy);
+	free(enc);
+	free(ref);
+	return wrong;
+}
+
+// Reads the monotonic clock.
+// Returns: the time in microseconds
+long long micros(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000LL+now.tv_nsec/1000;
+}
+
+// Converts a duration into a throughput.
+// Accepts: bytes processed, microseconds taken
+// Returns: mebibytes per second
+double rate(size_t bytes, long long usecs)
+{
+	return usecs > 0 ? bytes/(usecs/1e6)/(1<<20) : 0;
+}
+
+// Decodes netascii a piece at a time, as it would arrive in DATA blocks.
+// Accepts: the kernel, the netascii, its length, where to put the translation, the piece size, whether to vary the pieces' sizes at random up to that
+// Returns: the translation's length
+size_t decpieces(const struct asciikernel *k, const uint8_t *in, size_t len, uint8_t *out, size_t piece, bool vary)
+{
+	uint8_t *o = out;
+	bool cr = 0;
+	size_t at = 0;
+	while(at < len)
+	{
+		size_t next = vary ? 1+rand()%piece : piece;
+		if(next > len-at)
+			next = len-at;
+		o += k->dec(in+at, next, o, &cr);
+		at += next;
+	}
+	if(cr)
+		*o++ = '\r';
+	return o-out;
+}
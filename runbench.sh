@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs tftpbench against a fresh local tftpd, passing along any arguments, and prints its JSON report.
+# Set TFTPDFLAGS to pass flags to the server, and PROXYFLAGS to route the traffic through tftpproxy with those impairments.
+
+[ -d bench/ ] && rm -r bench/
+( ps -e | grep tftpd >/dev/null 2>&1 ) && killall tftpd
+
+set -e
+make tftpd tftpbench tftpproxy >/dev/null
+mkdir bench/
+
+# The server falls back to an unprivileged port if it can't bind the usual one:
+port=69
+[ "`id -u`" = 0 ] || port=1069
+
+cd bench/
+../tftpd $TFTPDFLAGS &
+server=$!
+if [ -n "$PROXYFLAGS" ]
+then
+	../tftpproxy -l 1070 $PROXYFLAGS localhost $port &
+	proxy=$!
+	port=1070
+fi
+sleep 1
+status=0
+../tftpbench "$@" localhost $port || status=$?
+kill $server
+[ -n "$PROXYFLAGS" ] && kill $proxy
+cd ../
+
+rm -r bench/
+exit $status
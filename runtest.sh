@@ -16,6 +16,7 @@ fortune -l >cli/putable
 
 cd srv/
 ../tftpd >../srv.log 2>&1 &
+srvpid=$!
 cd ../cli/
 ../tftp >../cli.log 2>&1 <<EOM
 c localhost
@@ -28,7 +29,7 @@ p getable
 q
 EOM
 cd ../
-kill %1
+kill $srvpid
 
 mkfifo left right
 diff left right &
@@ -46,6 +47,506 @@ tftp> tftp> tftp> tftp> tftp> tftp> tftp> tftp>
 EOM
 diff /dev/null srv.log
 
+# Move text both ways in netascii, in blocks small enough to split line endings between them:
+printf 'one\ntwo\r\nthree\rfour\r' >srv/gettext
+fortune -l >>srv/gettext
+cp srv/gettext cli/puttext
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+mo netascii
+b 8
+g gettext
+p puttext
+q
+EOM
+cd ../
+kill $srvpid
+
+cmp srv/gettext cli/gettext
+cmp srv/puttext cli/puttext
+diff /dev/null srv.log
+
+# Do the same through a proxy that strips every request's options, so that the mode must survive the server's ignoring them:
+printf 'one\ntwo\r\nthree\rfour\r' >srv/plaintext
+fortune -l >>srv/plaintext
+cp srv/plaintext cli/plainput
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../
+./tftpproxy -O localhost >/dev/null 2>&1 &
+proxypid=$!
+cd cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost 1070
+mo netascii
+g plaintext
+p plainput
+q
+EOM
+cd ../
+kill $proxypid $srvpid
+
+cmp srv/plaintext cli/plaintext
+cmp srv/plainput cli/plainput
+diff /dev/null srv.log
+
+# Move multi-gigabyte sparse files both ways, with enough blocks that their numbers wrap around several times:
+truncate -s 2G srv/bigget cli/bigput
+echo end >>srv/bigget
+echo end >>cli/bigput
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+b 8192
+w 32
+g bigget
+r 1
+p bigput
+q
+EOM
+cd ../
+kill $srvpid
+
+cmp srv/bigget cli/bigget
+cmp srv/bigput cli/bigput
+diff /dev/null srv.log
+
+# Download one file to several clients at once over multicast, slowly enough that the last, arriving a second late, has to join the transfer partway through:
+head -c 4000000 /dev/urandom >srv/mcast
+cd srv/
+../tftpd -M 239.255.0.1 -r 2000 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+pids=
+for client in 1 2 3 4
+do
+	mkdir $client/
+	[ $client -eq 4 ] && sleep 1
+	(cd $client/ && ../../tftp >/dev/null 2>&1 <<EOM
+c localhost
+mu on
+g mcast
+q
+EOM
+	) &
+	pids="$pids $!"
+done
+wait $pids
+cd ../
+kill $srvpid
+
+for client in 1 2 3 4
+do
+	cmp srv/mcast cli/$client/mcast
+done
+diff /dev/null srv.log
+
+# Refuse a first multicast port too high for every group port above it to exist:
+if ./tftpd -M 239.255.0.1:65281 2>srv.log; then false; fi
+grep -q 'port between 1 and 65280$' srv.log
+
+# Truncate a file in place while it's being downloaded slowly from the cache, which may fail only that download, then fetch what's left of it:
+head -c 2000000 /dev/urandom >srv/shrink
+cd srv/
+../tftpd -r 500 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+mkdir before/ after/
+(cd before/ && ../../tftp >/dev/null 2>&1 <<EOM
+c localhost
+g shrink
+q
+EOM
+) &
+sleep 1
+truncate -s 100000 ../srv/shrink
+wait $!
+cd after/
+../../tftp >../../cli.log 2>&1 <<EOM
+c localhost
+g shrink
+q
+EOM
+cd ../../
+kill $srvpid
+
+cmp srv/shrink cli/after/shrink
+diff /dev/null srv.log
+
+# Carry out several transfers at once on the server's own port, telling them apart by their clients:
+head -c 3000000 /dev/urandom >srv/sharedget
+head -c 3000000 /dev/urandom >cli/sharedput
+cd srv/
+../tftpd -P >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+pids=
+for client in shared1 shared2
+do
+	mkdir $client/
+	(cd $client/ && ../../tftp >/dev/null 2>&1 <<EOM
+c localhost
+w 8
+g sharedget
+q
+EOM
+	) &
+	pids="$pids $!"
+done
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+p sharedput
+q
+EOM
+wait $pids
+cd ../
+kill $srvpid
+
+cmp srv/sharedget cli/shared1/sharedget
+cmp srv/sharedget cli/shared2/sharedget
+cmp srv/sharedput cli/sharedput
+diff /dev/null srv.log
+
+# Download two files at once under a cap for their shared client address, which must hold them to about four seconds in all:
+head -c 1000000 /dev/urandom >srv/capped1
+head -c 1000000 /dev/urandom >srv/capped2
+cd srv/
+../tftpd -R 4000 -r 500 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+began=`date +%s`
+pids=
+for file in capped1 capped2
+do
+	(../tftp >/dev/null 2>&1 <<EOM
+c localhost
+g $file
+q
+EOM
+	) &
+	pids="$pids $!"
+done
+wait $pids
+ended=`date +%s`
+cd ../
+kill $srvpid
+
+cmp srv/capped1 cli/capped1
+cmp srv/capped2 cli/capped2
+[ $((ended-began)) -ge 3 ]
+diff /dev/null srv.log
+
+# Ask for more downloads at once than a server with room for one transfer and one waiting request will take, so that one waits its turn and one is turned away:
+head -c 1000000 /dev/urandom >srv/queued
+cd srv/
+../tftpd -c 1 -q 1 -R 1000 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+pids=
+for client in queue1 queue2 queue3
+do
+	mkdir $client/
+	(cd $client/ && ../../tftp >log 2>&1 <<EOM
+c localhost
+g queued
+q
+EOM
+	) &
+	pids="$pids $!"
+done
+wait $pids
+cd ../
+kill $srvpid
+
+served=0
+for client in queue1 queue2 queue3
+do
+	cmp -s srv/queued cli/$client/queued && served=$((served+1))
+done
+[ $served -eq 2 ]
+[ `cat cli/queue*/log | grep -c "Server busy"` -eq 1 ]
+diff /dev/null srv.log
+
+# Download through a proxy that duplicates every datagram, so that the server must recognize the repeated request instead of starting the transfer twice:
+head -c 1000000 /dev/urandom >srv/dupget
+cd srv/
+../tftpd -v >../srv.log 2>&1 &
+srvpid=$!
+cd ../
+./tftpproxy -D 100 localhost >/dev/null 2>&1 &
+proxypid=$!
+cd cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost 1070
+g dupget
+q
+EOM
+cd ../
+kill $proxypid $srvpid
+
+cmp srv/dupget cli/dupget
+[ `grep -c ": sending dupget$" srv.log` -eq 1 ]
+
+# Replace one file and create another that was missing while the server remembers looking both up, which it must notice rather than serving what it remembers:
+head -c 100000 /dev/urandom >srv/replaced
+cd srv/
+../tftpd -m 0 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+mkdir names1/ names2/
+cd names1/
+../../tftp >../../cli.log 2>&1 <<EOM
+c localhost
+g replaced
+g appeared
+q
+EOM
+cd ../../
+cmp srv/replaced cli/names1/replaced
+head -c 100000 /dev/urandom >srv/replacement
+mv srv/replacement srv/replaced
+head -c 100000 /dev/urandom >srv/appeared
+cd cli/names2/
+../../tftp >../../cli.log 2>&1 <<EOM
+c localhost
+g replaced
+g appeared
+q
+EOM
+cd ../../
+kill $srvpid
+
+cmp srv/replaced cli/names2/replaced
+cmp srv/appeared cli/names2/appeared
+diff /dev/null srv.log
+
+# Serve files packed into an archive, which aren't in the working directory at all, alongside one that's only in the working directory:
+mkdir srv/packed/
+head -c 100 /dev/urandom >srv/packed/small
+head -c 1000000 /dev/urandom >srv/packed/large
+head -c 10000 /dev/urandom >srv/loose
+./tftparchive srv/boot.arc srv/packed/ >/dev/null
+cd srv/
+../tftpd -A boot.arc >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+g small
+g large
+g loose
+q
+EOM
+cd ../
+kill $srvpid
+
+cmp srv/packed/small cli/small
+cmp srv/packed/large cli/large
+cmp srv/loose cli/loose
+diff /dev/null srv.log
+
+# Move files both ways through a proxy that drops, delays, jitters, and reorders datagrams in both directions, first with adaptive retransmission and then at a fixed interval negotiated with the timeout option:
+head -c 2000000 /dev/urandom >srv/lossyget
+head -c 2000000 /dev/urandom >cli/lossyput
+head -c 20000 /dev/urandom >srv/fixedget
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../
+./tftpproxy -L 5 -d 5 -j 2 -R 5 localhost >/dev/null 2>&1 &
+proxypid=$!
+cd cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost 1070
+b 1428
+w 8
+g lossyget
+p lossyput
+b 1024
+w 1
+timeout 1
+g fixedget
+q
+EOM
+cd ../
+kill $proxypid $srvpid
+
+cmp srv/lossyget cli/lossyget
+cmp srv/lossyput cli/lossyput
+cmp srv/fixedget cli/fixedget
+diff /dev/null srv.log
+
+# Cut off a slow download partway through, after which the server must retransmit until it gives up and then free the transfer:
+head -c 1000000 /dev/urandom >srv/abandoned
+cd srv/
+../tftpd -r 200 >../srv.log 2>&1 &
+srvpid=$!
+cd ../
+./tftpproxy localhost >/dev/null 2>&1 &
+proxypid=$!
+cd cli/
+../tftp >../cli.log 2>&1 <<EOM &
+c localhost 1070
+g abandoned
+q
+EOM
+clipid=$!
+sleep 1
+kill $proxypid
+wait $clipid
+sleep 8
+kill -USR1 $srvpid
+sleep 1
+cd ../
+kill $srvpid
+
+grep -q '"total":{[^}]*"started":1,"active":0,"succeeded":0,"failed":1,' srv.log
+
+# The server must announce a file's size, and each side must refuse a file that can't fit on its disk before any of it moves:
+head -c 300000 /dev/urandom >srv/sized
+truncate -s 8T srv/toobig
+truncate -s 8T cli/toobigput
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+progress on
+g sized
+p toobigput
+g toobig
+q
+EOM
+cd ../
+kill $srvpid
+
+cmp srv/sized cli/sized
+grep -q '300000 of 300000 bytes (100%)' cli.log
+grep -q '^remote: Disk full$' cli.log
+grep -q 'Not enough disk space$' cli.log
+if grep -q '[1-9][0-9]* of 8796093022208 bytes' cli.log; then false; fi
+test ! -e srv/toobigput
+test ! -e cli/toobig
+diff /dev/null srv.log
+
+# Move several files at once each way, both interactively and from a manifest, and refuse abbreviations that could mean more than one command:
+for each in 1 2 3 4 5 6; do
+	head -c $((each*70000)) /dev/urandom >srv/mget$each
+	head -c $((each*70000)) /dev/urandom >cli/mput$each
+	head -c $((each*30000)) /dev/urandom >srv/listget$each
+	head -c $((each*30000)) /dev/urandom >cli/listput$each
+done
+cat >manifest <<EOM
+# Comments and blank lines are skipped
+
+get listget1
+put listput1
+g listget2
+p listput2
+get listget3
+put listput3
+get listget4
+put listput4
+get listget5
+put listput5
+get listget6
+put listput6
+EOM
+cd srv/
+../tftpd >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+jobs 4
+mget mget1 mget2 mget3 mget4 mget5 mget6
+mput mput1 mput2 mput3 mput4 mput5 mput6
+m
+mu
+q
+EOM
+../tftp -j 3 -f ../manifest localhost >>../cli.log 2>&1
+cd ../
+kill $srvpid
+
+for each in 1 2 3 4 5 6; do
+	cmp srv/mget$each cli/mget$each
+	cmp srv/mput$each cli/mput$each
+	cmp srv/listget$each cli/listget$each
+	cmp srv/listput$each cli/listput$each
+done
+grep -q '^m: ambiguous directive$' cli.log
+grep -q 'multicast: off$' cli.log
+if grep -q '^\(local\|remote\):' cli.log; then false; fi
+diff /dev/null srv.log
+rm manifest
+
+# Upload a large file and several smaller ones at once through the background writer, syncing every MiB along the way:
+head -c 24000000 /dev/urandom >cli/spooled
+for each in 1 2 3 4; do
+	head -c $((each*1500000)) /dev/urandom >cli/spooled$each
+done
+cd srv/
+../tftpd -f 1 >../srv.log 2>&1 &
+srvpid=$!
+cd ../cli/
+../tftp >../cli.log 2>&1 <<EOM
+c localhost
+b 1428
+w 16
+p spooled
+jobs 4
+mput spooled1 spooled2 spooled3 spooled4
+q
+EOM
+cd ../
+kill $srvpid
+
+cmp srv/spooled cli/spooled
+for each in 1 2 3 4; do
+	cmp srv/spooled$each cli/spooled$each
+done
+diff /dev/null srv.log
+
+# Windowed transfers must come out the same whether the server has the kernel bundle datagrams (GSO and GRO, including on the shared socket) or moves them one at a time:
+head -c 5000003 /dev/urandom >srv/bundled
+head -c 5000003 /dev/urandom >cli/bundledput
+for flags in "" "-P" "-g" "-g -P"; do
+	cd srv/
+	../tftpd $flags >../srv.log 2>&1 &
+	srvpid=$!
+	cd ../cli/
+	../tftp >../cli.log 2>&1 <<EOM
+c localhost
+b 1428
+w 32
+g bundled
+p bundledput
+q
+EOM
+	cd ../
+	kill $srvpid
+
+	cmp srv/bundled cli/bundled
+	cmp srv/bundledput cli/bundledput
+	diff /dev/null srv.log
+	cksum <cli/bundled >>getsums
+	cksum <srv/bundledput >>putsums
+	rm cli/bundled srv/bundledput
+done
+test "$(sort -u getsums | wc -l)" -eq 1
+test "$(sort -u putsums | wc -l)" -eq 1
+rm getsums putsums
+
 rm -r srv/ cli/
 rm srv.log cli.log left right
 echo "All tests passed!"
@@ -17,51 +17,143 @@
 // Simple TFTP client implementation.
 // Author: Sol Boucher <slb1566@rit.edu>
 
-#include "tftp_protoc.h"
+#include "tftp_ascii.h"
+#include "tftp_xfer.h"
 #include <fcntl.h>
+#include <limits.h>
 #include <libgen.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Sex appeal:
 static const char *const SHL_PS1 = "tftp> ";
 
-// Interactive commands (must be wholly unambiguous):
+// Interactive commands, each of which may be abbreviated to any prefix no other shares.  The original few come first and take precedence over later additions, so that "p" still means put:
 static const char *const CMD_CON = "connect";
 static const char *const CMD_PUT = "put";
 static const char *const CMD_GET = "get";
+static const char *const CMD_BLK = "blksize";
+static const char *const CMD_WIN = "windowsize";
+static const char *const CMD_TMO = "timeout";
+static const char *const CMD_MCA = "multicast";
+static const char *const CMD_MGT = "mget";
+static const char *const CMD_MPT = "mput";
+static const char *const CMD_JOB = "jobs";
+static const char *const CMD_PRG = "progress";
+static const char *const CMD_ROL = "rollover";
+static const char *const CMD_MOD = "mode";
 static const char *const CMD_GFO = "quit";
 static const char *const CMD_HLP = "?";
+static const char *const *const CMDS[] = {&CMD_CON, &CMD_PUT, &CMD_GET, &CMD_GFO, &CMD_HLP, &CMD_BLK, &CMD_WIN, &CMD_TMO, &CMD_MCA, &CMD_MGT, &CMD_MPT, &CMD_JOB, &CMD_PRG, &CMD_ROL, &CMD_MOD};
+static const unsigned CMDS_ORIGINAL = 5;
 
+// One file to move as part of a get, put, or batch thereof:
+struct job
+{
+	const char *pathname;
+	bool putting;
+	const char *where; // Which side failed ("local" or "remote"), if either did
+	const char *error; // Human-readable reason for failure, or NULL
+	off_t bytes; // Size of the file once it's been moved
+};
+
+// Files being moved concurrently, which each thread claims one at a time:
+struct batch
+{
+	struct job *jobs;
+	unsigned count;
+	unsigned claimed;
+	const struct sockaddr_in *dest;
+	const struct xferopts *reqopts;
+};
+
+// Most transfers a batch carries out at once unless told otherwise:
+static const unsigned JOBS_DEFAULT = 8;
+
+static struct addrinfo *resolve(const char *, in_port_t);
+static void transfer(struct job *, const struct sockaddr_in *, const struct xferopts *, FILE *);
+static unsigned runbatch(struct job *, unsigned, unsigned, const struct sockaddr_in *, const struct xferopts *);
+static void *runner(void *);
+static int runmanifest(const char *, unsigned, const struct sockaddr_in *, const struct xferopts *);
+static bool setblksize(struct xferopts *, const char *);
+static bool setwindowsize(struct xferopts *, const char *);
+static bool settimeout(struct xferopts *, const char *);
+static bool setjobs(unsigned *, const char *);
 static void readin(char **, size_t *);
 static bool homog(const char *, char);
+static const char *expand(const char *);
 static void usage(const char *, const char *, const char *);
 static void noconn(const char *);
-static void sendreq(int, const char*, int, struct sockaddr *);
 
-// Runs the interactive loop and all file transfers.
+// Runs the interactive loop and all file transfers, or else just the transfers listed in a manifest.
+// Accepts: command-line arguments
 // Returns: exit status
-int main(void)
+int main(int argc, char **argv)
 {
-	// Used to control DNS resolution requests:
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
+	// Options we'll request for subsequent transfers:
+	struct xferopts reqopts;
+	initopts(&reqopts);
+	unsigned jobs = JOBS_DEFAULT;
+	bool progress = 0;
+
+	// Parse command-line flags:
+	const char *manifest = NULL;
+	int flag;
+	while((flag = getopt(argc, argv, "f:j:b:w:t:")) != -1)
+	{
+		if(flag == 'f')
+			manifest = optarg;
+		else if(flag == 'j')
+		{
+			if(!setjobs(&jobs, optarg))
+				return 1;
+		}
+		else if(flag == 'b')
+		{
+			if(!setblksize(&reqopts, optarg))
+				return 1;
+		}
+		else if(flag == 'w')
+		{
+			if(!setwindowsize(&reqopts, optarg))
+				return 1;
+		}
+		else if(flag == 't')
+		{
+			if(!settimeout(&reqopts, optarg))
+				return 1;
+		}
+		else
+			optind = argc+1;
+	}
+	if(manifest ? optind >= argc || argc-optind > 2 : optind != argc)
+	{
+		fprintf(stderr, "USAGE: %s [-j jobs] [-b blksize] [-w windowsize] [-t timeout] [-f manifest <hostname> [port]]\n", argv[0]);
+		return 1;
+	}
 
-	// Bind to an ephemeral network port:
 	struct addrinfo *server = NULL;
-	int sfd = openudp(0);
-	if(sfd < 0)
-		handle_error("bind()");
+
+	// Without a manifest, we're interactive:
+	if(manifest)
+	{
+		if(!(server = resolve(argv[optind], argc-optind > 1 ? atoi(argv[optind+1]) : PORT_UNPRIVILEGED)))
+			return 1;
+		int status = runmanifest(manifest, jobs, (struct sockaddr_in *)server->ai_addr, &reqopts);
+		freeaddrinfo(server);
+		return status;
+	}
 
 	// Allocate (small) space to store user input:
 	char *buf = malloc(1);
 	size_t cap = 1;
 	char *cmd; // First word of buf
-	size_t len; // Length of cmd
+	const char *which; // The command it abbreviates, if exactly one
 
 	// Main input loop, which normally only breaks upon a GFO:
 	do
@@ -76,9 +168,10 @@ int main(void)
 
 		// Cleave off the command (first word):
 		cmd = strtok(buf, " ");
-		len = strlen(cmd);
+		if(!(which = expand(cmd)))
+			continue;
 
-		if(strncmp(cmd, CMD_CON, len) == 0)
+		if(which == CMD_CON)
 		{
 			// Read the arguments:
 			const char *hostname = strtok(NULL, " ");
@@ -102,18 +195,11 @@ int main(void)
 			}
 
 			// Try to resolve the requested hostname:
-			if(getaddrinfo(hostname, NULL, &hints, &server))
-			{
-				fprintf(stderr, "Unable to resolve hostname\n");
-				freeaddrinfo(server);
-				server = NULL;
-				continue;
-			}
-			((struct sockaddr_in *)server->ai_addr)->sin_port = htons(port);
+			server = resolve(hostname, port);
 		}
-		else if(strncmp(cmd, CMD_GET, len) == 0 || strncmp(cmd, CMD_PUT, len) == 0)
+		else if(which == CMD_GET || which == CMD_PUT)
 		{
-			bool putting = strncmp(cmd, CMD_PUT, 1) == 0;
+			bool putting = which == CMD_PUT;
 
 			// Ensure we're already connected to a server:
 			if(!server)
@@ -130,75 +216,163 @@ int main(void)
 				continue;
 			}
 
-			// Since basename() might modify pathname, copy it:
-			char filename[strlen(pathname)+1];
-			memcpy(filename, pathname, sizeof filename);
+			struct job job = {pathname, putting};
+			transfer(&job, (struct sockaddr_in *)server->ai_addr, &reqopts, progress ? stderr : NULL);
+			if(job.error)
+				fprintf(stderr, "%s: %s\n", job.where, job.error);
+		}
+		else if(which == CMD_BLK)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && !setblksize(&reqopts, tmp))
+				continue;
+			printf("%s: %zu\n", CMD_BLK, reqopts.blksize);
+		}
+		else if(which == CMD_WIN)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && !setwindowsize(&reqopts, tmp))
+				continue;
+			printf("%s: %u\n", CMD_WIN, reqopts.windowsize);
+		}
+		else if(which == CMD_TMO)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && !settimeout(&reqopts, tmp))
+				continue;
+			if(reqopts.timeout)
+				printf("%s: %u\n", CMD_TMO, reqopts.timeout);
+			else
+				printf("%s: adaptive\n", CMD_TMO);
+		}
+		else if(which == CMD_MCA)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && strcmp(tmp, "on") == 0)
+				reqopts.present |= OPTF_MULTICAST;
+			else if(tmp && strcmp(tmp, "off") == 0)
+				reqopts.present &= ~OPTF_MULTICAST;
+			else if(tmp)
+			{
+				fprintf(stderr, "%s: must be on or off\n", CMD_MCA);
+				continue;
+			}
+			printf("%s: %s\n", CMD_MCA, reqopts.present & OPTF_MULTICAST ? "on" : "off");
+		}
+		else if(which == CMD_MGT || which == CMD_MPT)
+		{
+			bool putting = which == CMD_MPT;
+
+			// Ensure we're already connected to a server:
+			if(!server)
+			{
+				noconn(cmd);
+				continue;
+			}
 
-			int fd;
-			if(putting)
+			// Every remaining word names a file:
+			char *pathnames = strtok(NULL, "");
+			if(!pathnames || homog(pathnames, ' '))
 			{
-				// Try opening the file for reading:
-				if((fd = open(pathname, O_RDONLY)) < 0)
-				{
-					fprintf(stderr, "local: Unable to read specified file\n");
-					continue;
-				}
-
-				// Send a request and record the port used to acknowledge:
-				struct sockaddr_in dest_addr;
-				sendreq(sfd, basename(filename), OPC_WRQ, server->ai_addr);
-				uint8_t *rmtack = recvpkta(sfd, &dest_addr);
-				if(iserr(rmtack))
-				{
-					fprintf(stderr, "remote: %s\n", strerr(rmtack));
-					free(rmtack);
-					continue;
-				}
-				free(rmtack);
-
-				// Transmit the file:
-				sendfile(sfd, fd, &dest_addr);
+				usage(putting ? CMD_MPT : CMD_MGT, "pathname", "pathname ...");
+				continue;
 			}
-			else // getting
+			struct job files[strlen(pathnames)/2+1];
+			unsigned count = 0;
+			char *pathname;
+			for(pathname = strtok(pathnames, " "); pathname; pathname = strtok(NULL, " "))
 			{
-				// Try opening a file of that name for writing:
-				if((fd = open(basename(filename), O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0)
-				{
-					fprintf(stderr, "local: Unable to create the new file\n");
-					continue;
-				}
-
-				// Send a request and await the incoming file:
-				sendreq(sfd, pathname, OPC_RRQ, server->ai_addr);
-				const char *res = recvfile(sfd, fd);
-				if(res)
-				{
-					fprintf(stderr, "remote: %s\n", res);
-					close(fd);
-					fd = -1;
-					unlink(basename(filename));
-				}
+				memset(files+count, 0, sizeof *files);
+				files[count].pathname = pathname;
+				files[count++].putting = putting;
 			}
 
-			if(fd >= 0)
-				close(fd);
+			runbatch(files, count, jobs, (struct sockaddr_in *)server->ai_addr, &reqopts);
+		}
+		else if(which == CMD_JOB)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && !setjobs(&jobs, tmp))
+				continue;
+			printf("%s: %u\n", CMD_JOB, jobs);
+		}
+		else if(which == CMD_PRG)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && strcmp(tmp, "on") == 0)
+				progress = 1;
+			else if(tmp && strcmp(tmp, "off") == 0)
+				progress = 0;
+			else if(tmp)
+			{
+				fprintf(stderr, "%s: must be on or off\n", CMD_PRG);
+				continue;
+			}
+			printf("%s: %s\n", CMD_PRG, progress ? "on" : "off");
+		}
+		else if(which == CMD_ROL)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && (strcmp(tmp, "0") == 0 || strcmp(tmp, "1") == 0))
+			{
+				reqopts.present |= OPTF_ROLLOVER;
+				reqopts.rollover = *tmp-'0';
+			}
+			else if(tmp && strcmp(tmp, "off") == 0)
+				reqopts.present &= ~OPTF_ROLLOVER;
+			else if(tmp)
+			{
+				fprintf(stderr, "%s: must be 0, 1, or off\n", CMD_ROL);
+				continue;
+			}
+			if(reqopts.present & OPTF_ROLLOVER)
+				printf("%s: %u\n", CMD_ROL, reqopts.rollover);
+			else
+				printf("%s: off\n", CMD_ROL);
 		}
-		else if(strncmp(cmd, CMD_HLP, len) == 0)
+		else if(which == CMD_MOD)
+		{
+			// Without an argument, just report the current setting:
+			const char *tmp = strtok(NULL, " ");
+			if(tmp && strcmp(tmp, MODE_ASCII) == 0)
+				reqopts.netascii = 1;
+			else if(tmp && strcmp(tmp, MODE_OCTET) == 0)
+				reqopts.netascii = 0;
+			else if(tmp)
+			{
+				fprintf(stderr, "%s: must be %s or %s\n", CMD_MOD, MODE_ASCII, MODE_OCTET);
+				continue;
+			}
+			printf("%s: %s\n", CMD_MOD, reqopts.netascii ? MODE_ASCII : MODE_OCTET);
+		}
+		else if(which == CMD_HLP)
 		{
 			printf("Commands may be abbreviated.  Commands are:\n\n");
 			printf("%s\t\tconnect to remote tftp\n", CMD_CON);
 			printf("%s\t\tsend file\n", CMD_PUT);
 			printf("%s\t\treceive file\n", CMD_GET);
+			printf("%s\t\tsend several files at once\n", CMD_MPT);
+			printf("%s\t\treceive several files at once\n", CMD_MGT);
+			printf("%s\t\tset number of files to move at once\n", CMD_JOB);
+			printf("%s\t\tset block size for transfers\n", CMD_BLK);
+			printf("%s\tset number of blocks in flight\n", CMD_WIN);
+			printf("%s\t\tset seconds between retransmissions\n", CMD_TMO);
+			printf("%s\tshare downloads with other clients\n", CMD_MCA);
+			printf("%s\tshow the rate and time left while transferring\n", CMD_PRG);
+			printf("%s\tset block number to follow 65535\n", CMD_ROL);
+			printf("%s\t\tset whether to translate line endings\n", CMD_MOD);
 			printf("%s\t\texit tftp\n", CMD_GFO);
 			printf("%s\t\tprint help information\n", CMD_HLP);
 		}
-		else if(strncmp(cmd, CMD_GFO, len) != 0)
-		{
-			fprintf(stderr, "%s: unknown directive\n", cmd);
-			fprintf(stderr, "Try ? for help.\n");
-		}
 	}
-	while(strncmp(cmd, CMD_GFO, len) != 0);
+	while(which != CMD_GFO);
 
 	free(buf);
 	if(server)
@@ -207,6 +381,302 @@ int main(void)
 	return 0;
 }
 
+// Resolves a server's hostname, complaining if it can't.
+// Accepts: the hostname or IP, the port
+// Returns: its address, to be freed with freeaddrinfo(), or NULL
+struct addrinfo *resolve(const char *hostname, in_port_t port)
+{
+	// Used to control DNS resolution requests:
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo *server = NULL;
+	if(getaddrinfo(hostname, NULL, &hints, &server))
+	{
+		fprintf(stderr, "Unable to resolve hostname\n");
+		return NULL;
+	}
+	((struct sockaddr_in *)server->ai_addr)->sin_port = htons(port);
+	return server;
+}
+
+// Sends or receives one file, on a fresh ephemeral port so stragglers from earlier transfers can't be mistaken for replies.
+// Accepts: the job, which is updated with the outcome; the server's address; the options to request; where to report progress or NULL
+void transfer(struct job *job, const struct sockaddr_in *dest, const struct xferopts *reqopts, FILE *progress)
+{
+	// Since basename() might modify pathname, copy it:
+	char filename[strlen(job->pathname)+1];
+	memcpy(filename, job->pathname, sizeof filename);
+
+	// Start from the options we'd like, and learn which the server grants:
+	struct xferopts opts = *reqopts;
+
+	int fd;
+	if(job->putting)
+		fd = open(job->pathname, O_RDONLY);
+	else
+		fd = open(basename(filename), O_WRONLY|O_CREAT|O_EXCL, 0666);
+	if(fd < 0)
+	{
+		job->where = "local";
+		job->error = job->putting ? "Unable to read specified file" : "Unable to create the new file";
+		return;
+	}
+
+	int sfd = openudp(0);
+	if(sfd < 0)
+		handle_error("bind()");
+
+	struct stat st;
+	uint8_t *req = pktget();
+	if(!req)
+	{
+		if(!job->putting)
+			unlink(basename(filename));
+		job->where = "local";
+		job->error = "Out of packet buffers";
+	}
+	else if(job->putting)
+	{
+		// Say how big the file is, so the server can make room for it, which for netascii means how big its translation will be:
+		off_t size = opts.netascii ? asciisize(fd) : !fstat(fd, &st) ? st.st_size : -1;
+		if(size >= 0)
+		{
+			opts.present |= OPTF_TSIZE;
+			opts.tsize = size;
+		}
+
+		// Ask to write the file, then transmit it:
+		size_t req_len = fmtreq(req, PKT_MAX, basename(filename), OPC_WRQ, &opts);
+		if(req_len)
+			job->error = sendfile(sfd, fd, &opts, req, req_len, dest, progress);
+		else
+		{
+			job->where = "local";
+			job->error = "Pathname too long to request";
+		}
+	}
+	else // getting
+	{
+		// Multicast blocks may arrive out of order, which a netascii file can't be written in:
+		if(opts.netascii)
+			opts.present &= ~OPTF_MULTICAST;
+
+		// Learn how big the file is whenever that doesn't cost an extra round trip, or we need it to estimate the time left:
+		if(opts.present || progress)
+		{
+			opts.present |= OPTF_TSIZE;
+			opts.tsize = 0;
+		}
+
+		// Ask for the file and await its arrival:
+		size_t req_len = fmtreq(req, PKT_MAX, job->pathname, OPC_RRQ, &opts);
+		if(req_len)
+			job->error = recvfile(sfd, fd, &opts, req, req_len, dest, progress);
+		else
+		{
+			job->where = "local";
+			job->error = "Pathname too long to request";
+		}
+		if(job->error)
+			unlink(basename(filename));
+	}
+	if(req)
+		pktput(req);
+	close(sfd);
+
+	if(job->error && !job->where)
+		job->where = "remote";
+	else if(!fstat(fd, &st))
+		job->bytes = st.st_size;
+	close(fd);
+}
+
+// Moves many files concurrently, reporting each failure as it happens and then summarizing the whole lot.
+// Accepts: the jobs, how many there are, most to run at once, the server's address, the options to request
+// Returns: how many failed
+unsigned runbatch(struct job *jobs, unsigned count, unsigned concurrency, const struct sockaddr_in *dest, const struct xferopts *reqopts)
+{
+	struct batch batch = {jobs, count, 0, dest, reqopts};
+	unsigned nthreads = concurrency < count ? concurrency : count;
+	pthread_t threads[nthreads];
+	long long began = xfermicros();
+
+	// This thread helps out, then waits for the rest:
+	unsigned index;
+	for(index = 1; index < nthreads; ++index)
+		if(pthread_create(threads+index, NULL, &runner, &batch))
+			handle_error("pthread_create()");
+	runner(&batch);
+	for(index = 1; index < nthreads; ++index)
+		pthread_join(threads[index], NULL);
+	double elapsed = (xfermicros()-began)/1e6;
+
+	unsigned failed = 0;
+	unsigned long long bytes = 0;
+	for(index = 0; index < count; ++index)
+	{
+		failed += jobs[index].error != NULL;
+		bytes += jobs[index].bytes;
+	}
+	printf("%u of %u files transferred, %llu bytes in %.3f seconds (%.0f bytes/s)\n", count-failed, count, bytes, elapsed, elapsed > 0 ? bytes/elapsed : 0);
+	return failed;
+}
+
+// Carries out a batch's jobs one after another until none remain unclaimed.
+// Accepts: the batch
+// Returns: NULL
+void *runner(void *arg)
+{
+	struct batch *batch = arg;
+	unsigned index;
+	while((index = __atomic_fetch_add(&batch->claimed, 1, __ATOMIC_RELAXED)) < batch->count)
+	{
+		struct job *job = batch->jobs+index;
+		transfer(job, batch->dest, batch->reqopts, NULL);
+		if(job->error)
+			fprintf(stderr, "%s: %s: %s\n", job->pathname, job->where, job->error);
+	}
+	return NULL;
+}
+
+// Moves every file listed in a manifest, each line of which names one to get or put (like the interactive command of the same name).  Blank lines and those beginning with # are ignored.
+// Accepts: the manifest's path, most files to move at once, the server's address, the options to request
+// Returns: exit status
+int runmanifest(const char *path, unsigned concurrency, const struct sockaddr_in *dest, const struct xferopts *reqopts)
+{
+	FILE *in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if(!in)
+	{
+		fprintf(stderr, "%s: unable to read manifest\n", path);
+		return 1;
+	}
+
+	// Make sure the whole thing makes sense before starting anything:
+	struct job *jobs = NULL;
+	unsigned count = 0;
+	unsigned line = 0;
+	char *buf = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while((len = getline(&buf, &cap, in)) >= 0)
+	{
+		++line;
+		if(len && buf[len-1] == '\n')
+			buf[--len] = '\0';
+
+		char *cmd = strtok(buf, " \t");
+		if(!cmd || *cmd == '#')
+			continue;
+		char *pathname = strtok(NULL, "");
+		size_t cmdlen = strlen(cmd);
+		if((strncmp(cmd, CMD_GET, cmdlen) && strncmp(cmd, CMD_PUT, cmdlen)) || !pathname)
+		{
+			fprintf(stderr, "%s:%u: expected %s or %s and a pathname\n", path, line, CMD_GET, CMD_PUT);
+			free(buf);
+			free(jobs);
+			return 1;
+		}
+
+		if(!(count & (count-1)))
+			jobs = realloc(jobs, (count ? 2*count : 1)*sizeof *jobs);
+		memset(jobs+count, 0, sizeof *jobs);
+		jobs[count].pathname = strdup(pathname);
+		jobs[count++].putting = *cmd == *CMD_PUT;
+	}
+	free(buf);
+	if(in != stdin)
+		fclose(in);
+
+	unsigned failed = count ? runbatch(jobs, count, concurrency, dest, reqopts) : 0;
+	while(count)
+		free((char *)jobs[--count].pathname);
+	free(jobs);
+	return failed != 0;
+}
+
+// Updates the block size to request, or complains if it's out of range.
+// Accepts: the options, the size as typed
+// Returns: whether it was acceptable
+bool setblksize(struct xferopts *opts, const char *typed)
+{
+	size_t blksize = atoi(typed);
+	if(blksize < BLKSIZE_MIN || blksize > BLKSIZE_MAX)
+	{
+		fprintf(stderr, "%s: must be between %zu and %zu\n", CMD_BLK, BLKSIZE_MIN, BLKSIZE_MAX);
+		return 0;
+	}
+
+	// Only bother negotiating if we want something nonstandard:
+	opts->blksize = blksize;
+	if(blksize == DATA_LEN)
+		opts->present &= ~OPTF_BLKSIZE;
+	else
+		opts->present |= OPTF_BLKSIZE;
+	return 1;
+}
+
+// Updates the window size to request, or complains if it's out of range.
+// Accepts: the options, the size as typed
+// Returns: whether it was acceptable
+bool setwindowsize(struct xferopts *opts, const char *typed)
+{
+	unsigned windowsize = atoi(typed);
+	if(windowsize < 1 || windowsize > WINDOWSIZE_MAX)
+	{
+		fprintf(stderr, "%s: must be between 1 and %u\n", CMD_WIN, WINDOWSIZE_MAX);
+		return 0;
+	}
+
+	// Only bother negotiating if we want to pipeline:
+	opts->windowsize = windowsize;
+	if(windowsize == 1)
+		opts->present &= ~OPTF_WINDOWSIZE;
+	else
+		opts->present |= OPTF_WINDOWSIZE;
+	return 1;
+}
+
+// Updates the retransmission timeout to request, or complains if it's out of range.
+// Accepts: the options, the number of seconds (or 0 to adapt to round-trip times) as typed
+// Returns: whether it was acceptable
+bool settimeout(struct xferopts *opts, const char *typed)
+{
+	unsigned timeout = atoi(typed);
+	if(timeout > TIMEOUT_MAX)
+	{
+		fprintf(stderr, "%s: must be between 0 (adaptive) and %u\n", CMD_TMO, TIMEOUT_MAX);
+		return 0;
+	}
+
+	// Only bother negotiating if we want a fixed interval:
+	opts->timeout = timeout;
+	if(!timeout)
+		opts->present &= ~OPTF_TIMEOUT;
+	else
+		opts->present |= OPTF_TIMEOUT;
+	return 1;
+}
+
+// Updates how many files a batch moves at once, or complains if that isn't a positive number.
+// Accepts: the setting, the count as typed
+// Returns: whether it was acceptable
+bool setjobs(unsigned *jobs, const char *typed)
+{
+	char *unparsed;
+	long count = strtol(typed, &unparsed, 10);
+	if(unparsed == typed || *unparsed || count < 1 || count > INT_MAX)
+	{
+		fprintf(stderr, "%s: must be between 1 and %d\n", CMD_JOB, INT_MAX);
+		return 0;
+	}
+
+	*jobs = count;
+	return 1;
+}
+
 // Reads one line of input from standard input into the provided buffer.  Each time the buffer would overflow, it is reallocated at double its previous size.
 // Accepts: the target buffer, its length in bytes
 void readin(char **bufptr, size_t *bufcap)
@@ -252,6 +722,31 @@ bool homog(const char *str, char chr)
 	return 1;
 }
 
+// Expands an abbreviated interactive command, complaining to standard error if it matches none or several.  A command typed in full is never ambiguous, even if it begins another, and neither is any abbreviation of an original command.
+// Accepts: that which was typed
+// Returns: the command, or NULL if there isn't exactly one
+const char *expand(const char *typed)
+{
+	size_t len = strlen(typed);
+	const char *match = NULL;
+	unsigned matches = 0;
+	unsigned index;
+	for(index = 0; index < sizeof CMDS/sizeof *CMDS; ++index)
+	{
+		const char *cmd = *CMDS[index];
+		if(strcmp(typed, cmd) == 0 || (index < CMDS_ORIGINAL && strncmp(typed, cmd, len) == 0))
+			return cmd;
+		if(strncmp(typed, cmd, len) == 0 && !matches++)
+			match = cmd;
+	}
+	if(matches == 1)
+		return match;
+
+	fprintf(stderr, "%s: %s directive\n", typed, matches ? "ambiguous" : "unknown");
+	fprintf(stderr, "Try ? for help.\n");
+	return NULL;
+}
+
 // Prints to standard error the usage string describing a command expecting one required argument and up to one optional argument.
 // Accepts: the command, its required argument, and its optional argument or NULL
 void usage(const char *cmd, const char *reqd, const char *optl)
@@ -272,14 +767,3 @@ void noconn(const char *typed)
 	fprintf(stderr, "%s: expects existing connection\n", typed);
 	fprintf(stderr, "Did you call %s?\n", CMD_CON);
 }
-
-// Sends a request datagram over the network specifying transfer type octal.
-// Accepts: local socket file descriptor, requested filename, OPC_RRQ or OPC_WRQ, and remote socket address
-void sendreq(int sfd, const char* pathname, int opcode, struct sockaddr *dest)
-{
-	uint8_t req[2+strlen(pathname)+1+strlen(MODE_OCTET)+1];
-	*(uint16_t *)req = opcode;
-	strcpy(req+2, pathname);
-	strcpy(req+2+strlen(pathname)+1, MODE_OCTET);
-	sendto(sfd, req, sizeof req, 0, dest, sizeof(struct sockaddr_in));
-}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Netascii translation implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftp_ascii.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Bytes of a file to measure at a time:
+#define CHUNK_LEN (64*1024)
+
+static size_t encscalar(const uint8_t *, size_t, uint8_t *);
+static size_t decscalar(const uint8_t *, size_t, uint8_t *, bool *);
+#ifdef __SSE2__
+static size_t encsse2(const uint8_t *, size_t, uint8_t *);
+static size_t decsse2(const uint8_t *, size_t, uint8_t *, bool *);
+static size_t encavx2(const uint8_t *, size_t, uint8_t *) __attribute__((target("avx2")));
+static size_t decavx2(const uint8_t *, size_t, uint8_t *, bool *) __attribute__((target("avx2,popcnt")));
+static uint8_t *squeeze(uint8_t *, __m128i, unsigned, uint8_t) __attribute__((target("avx2,popcnt")));
+static void squeezeinit(void);
+
+// For each set of the 8 bytes to keep, the shuffle that packs them together at the front:
+static uint8_t squeezes[256][8];
+static pthread_once_t squeezing = PTHREAD_ONCE_INIT;
+#endif
+
+// Lists the implementations this processor can run.
+// Returns: an array of them, fastest first and terminated by one without a name
+const struct asciikernel *asciikernels(void)
+{
+	static const struct asciikernel all[] =
+	{
+#ifdef __SSE2__
+		{"avx2", &encavx2, &decavx2},
+		{"sse2", &encsse2, &decsse2},
+#endif
+		{"scalar", &encscalar, &decscalar},
+		{NULL, NULL, NULL},
+	};
+
+#ifdef __SSE2__
+	if(!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("popcnt"))
+		return all+1;
+	pthread_once(&squeezing, &squeezeinit);
+#endif
+	return all;
+}
+
+// Translates local text into netascii.  Since this needs no context, a file may be split anywhere.
+// Accepts: the text, its length, where to put the translation, which must have room for twice as much
+// Returns: the translation's length
+size_t asciienc(const uint8_t *in, size_t len, uint8_t *out)
+{
+	return asciikernels()->enc(in, len, out);
+}
+
+// Translates netascii back into local text, a piece at a time.  A CR at the end of one piece pairs with the start of the next, so it's held back until then; if it ends the file, it stands on its own.
+// Accepts: the netascii, its length, where to put the translation, which must have room for one more byte, whether the last piece ended with a CR (updated for this one)
+// Returns: the translation's length
+size_t asciidec(const uint8_t *in, size_t len, uint8_t *out, bool *cr)
+{
+	return asciikernels()->dec(in, len, out, cr);
+}
+
+// Measures how long a file will be once it's translated into netascii, as whoever sends one must say before it's gone through.
+// Accepts: the file
+// Returns: the translation's length, or -1 with errno set
+off_t asciisize(int fd)
+{
+	uint8_t *in = malloc(CHUNK_LEN);
+	if(!in)
+		return -1;
+
+	ssize_t len;
+	off_t off = 0;
+	off_t size = 0;
+	while((len = pread(fd, in, CHUNK_LEN, off)) > 0 || (len < 0 && errno == EINTR))
+	{
+		if(len < 0)
+			continue;
+		off += len;
+		size += len;
+
+		// Each CR or LF becomes two bytes:
+		ssize_t each;
+		for(each = 0; each < len; ++each)
+			size += in[each] == '\r' || in[each] == '\n';
+	}
+	free(in);
+	return len < 0 ? -1 : size;
+}
+
+// Encodes one byte at a time, for processors without vector instructions and the ends of buffers.
+// Accepts: the text, its length, where to put the translation
+// Returns: the translation's length
+size_t encscalar(const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t *o = out;
+	size_t each;
+	for(each = 0; each < len; ++each)
+	{
+		uint8_t c = in[each];
+		if(c == '\n' || c == '\r')
+		{
+			*o++ = '\r';
+			*o++ = c == '\n' ? '\n' : '\0';
+		}
+		else
+			*o++ = c;
+	}
+	return o-out;
+}
+
+// Decodes one byte at a time, for processors without vector instructions and the ends of buffers.
+// Accepts: the netascii, its length, where to put the translation, whether a CR is pending
+// Returns: the translation's length
+size_t decscalar(const uint8_t *in, size_t len, uint8_t *out, bool *cr)
+{
+	uint8_t *o = out;
+	size_t each;
+	for(each = 0; each < len; ++each)
+	{
+		uint8_t c = in[each];
+		if(*cr)
+		{
+			// A pair stands for a single character, and anything else leaves the CR as it was:
+			*cr = 0;
+			if(c == '\n' || c == '\0')
+			{
+				*o++ = c == '\n' ? '\n' : '\r';
+				continue;
+			}
+			*o++ = '\r';
+		}
+		if(c == '\r')
+			*cr = 1;
+		else
+			*o++ = c;
+	}
+	return o-out;
+}
+
+#ifdef __SSE2__
+// Encodes 16 bytes at a time.  Each vector is copied out whole, then each CR or LF in it is replaced by its pair, and everything after copied out again one byte further along.  Bytes written past the end are overwritten by the next vector.
+// Accepts: the text, its length, where to put the translation
+// Returns: the translation's length
+size_t encsse2(const uint8_t *in, size_t len, uint8_t *out)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint8_t *o = out;
+	size_t at = 0;
+	while(at+32 <= len)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in+at));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		_mm_storeu_si128((__m128i *)o, v);
+		while(mask)
+		{
+			unsigned bit = __builtin_ctz(mask);
+			o[bit] = '\r';
+			o[bit+1] = in[at+bit] == '\n' ? '\n' : '\0';
+			_mm_storeu_si128((__m128i *)(o+bit+2), _mm_loadu_si128((const __m128i *)(in+at+bit+1)));
+			++o;
+			mask &= mask-1;
+		}
+		o += 16;
+		at += 16;
+	}
+	return o-out+encscalar(in+at, len-at, o);
+}
+
+// Decodes 16 bytes at a time in the same fashion, dropping the CR of each CR LF and the NUL of each CR NUL.  Looking ahead to the byte after each CR means none is ever left pending between vectors, though a NUL just past one may have to be skipped.
+// Accepts: the netascii, its length, where to put the translation, whether a CR is pending
+// Returns: the translation's length
+size_t decsse2(const uint8_t *in, size_t len, uint8_t *out, bool *cr)
+{
+	const __m128i cret = _mm_set1_epi8('\r');
+	uint8_t *o = out;
+	size_t at = 0;
+	while(at < len && *cr)
+		o += decscalar(in+at++, 1, o, cr);
+	while(at+33 <= len)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in+at));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cret));
+		size_t next = at+16;
+		_mm_storeu_si128((__m128i *)o, v);
+		while(mask)
+		{
+			unsigned bit = __builtin_ctz(mask);
+			uint8_t after = in[at+bit+1];
+			if(after == '\n')
+			{
+				_mm_storeu_si128((__m128i *)(o+bit), _mm_loadu_si128((const __m128i *)(in+at+bit+1)));
+				--o;
+			}
+			else if(!after)
+			{
+				_mm_storeu_si128((__m128i *)(o+bit+1), _mm_loadu_si128((const __m128i *)(in+at+bit+2)));
+				if(bit == 15)
+					++next;
+				else
+					--o;
+			}
+			mask &= mask-1;
+		}
+		o += 16;
+		at = next;
+	}
+	return o-out+decscalar(in+at, len-at, o, cr);
+}
+
+// Encodes 32 bytes at a time, just as with SSE2.
+// Accepts: the text, its length, where to put the translation
+// Returns: the translation's length
+size_t encavx2(const uint8_t *in, size_t len, uint8_t *out)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	uint8_t *o = out;
+	size_t at = 0;
+	while(at+64 <= len)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in+at));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		_mm256_storeu_si256((__m256i *)o, v);
+		while(mask)
+		{
+			unsigned bit = __builtin_ctz(mask);
+			o[bit] = '\r';
+			o[bit+1] = in[at+bit] == '\n' ? '\n' : '\0';
+			_mm256_storeu_si256((__m256i *)(o+bit+2), _mm256_loadu_si256((const __m256i *)(in+at+bit+1)));
+			++o;
+			mask &= mask-1;
+		}
+		o += 32;
+		at += 32;
+	}
+
+	// Leaving the upper halves of the registers dirty would slow down the SSE code that follows:
+	_mm256_zeroupper();
+	return o-out+encsse2(in+at, len-at, o);
+}
+
+// Fills in the table of shuffles used by the AVX2 decoder.
+void squeezeinit(void)
+{
+	unsigned keep;
+	for(keep = 0; keep < 256; ++keep)
+	{
+		unsigned bit;
+		unsigned kept = 0;
+		for(bit = 0; bit < 8; ++bit)
+			if(keep & 1<<bit)
+				squeezes[keep][kept++] = bit;
+		while(kept < 8)
+			squeezes[keep][kept++] = 0x80;
+	}
+}
+
+// Packs together the bytes to keep out of 8 of a vector's, writing all 8 places in case they all are.
+// Accepts: where to put them, the vector, a bit for each of the 8 that's set if it's to be kept, which byte of the vector is the first of them
+// Returns: the end of what was kept
+uint8_t *squeeze(uint8_t *out, __m128i v, unsigned keep, uint8_t first)
+{
+	keep &= 0xff;
+	__m128i shuffle = _mm_add_epi8(_mm_loadl_epi64((const __m128i *)squeezes[keep]), _mm_set1_epi8(first));
+	_mm_storel_epi64((__m128i *)out, _mm_shuffle_epi8(v, shuffle));
+	return out+__builtin_popcount(keep);
+}
+
+// Decodes 32 bytes at a time, just as with SSE2.  That needs a vector's worth of lookahead, so what's left at the end is instead handled a vector at a time by working out at once which bytes to drop (each CR followed by an LF, and each NUL preceded by a CR) and packing together the rest with shuffles.  The last such vector is aligned with the end of the input, overlapping the one before, so that nothing is left over for a slower loop.
+// Accepts: the netascii, its length, where to put the translation, whether a CR is pending
+// Returns: the translation's length
+size_t decavx2(const uint8_t *in, size_t len, uint8_t *out, bool *cr)
+{
+	const __m256i cret = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	if(len < 32)
+		return decsse2(in, len, out, cr);
+
+	uint8_t *o = out;
+	size_t at = 0;
+	while(at < len && *cr)
+		o += decscalar(in+at++, 1, o, cr);
+	while(at+65 <= len)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in+at));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cret));
+		size_t next = at+32;
+		_mm256_storeu_si256((__m256i *)o, v);
+		while(mask)
+		{
+			unsigned bit = __builtin_ctz(mask);
+			uint8_t after = in[at+bit+1];
+			if(after == '\n')
+			{
+				_mm256_storeu_si256((__m256i *)(o+bit), _mm256_loadu_si256((const __m256i *)(in+at+bit+1)));
+				--o;
+			}
+			else if(!after)
+			{
+				_mm256_storeu_si256((__m256i *)(o+bit+1), _mm256_loadu_si256((const __m256i *)(in+at+bit+2)));
+				if(bit == 31)
+					++next;
+				else
+					--o;
+			}
+			mask &= mask-1;
+		}
+		o += 32;
+		at = next;
+	}
+
+	// Neither loop above leaves off right after a CR whose pair is still to come:
+	while(at < len)
+	{
+		size_t from = at+32 <= len ? at : len-32;
+		bool last = from+32 == len;
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in+from));
+		unsigned crs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cret));
+		unsigned lfs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+		unsigned nuls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		unsigned ahead = !last && in[from+32] == '\n';
+		unsigned drop = (crs & (lfs>>1 | ahead<<31)) | (nuls & crs<<1);
+
+		// Bytes shared with the vector before have already been translated, and a CR at the very end is held back:
+		drop |= ~(~0u<<(at-from));
+		if(last && crs>>31)
+		{
+			drop |= 1u<<31;
+			*cr = 1;
+		}
+		at = from+32;
+
+		// A NUL just past the vector pairs with a CR that ends it:
+		if(!last && crs>>31 && !in[at])
+			++at;
+
+		// Only the last vector might not have room to be written out whole:
+		uint8_t tail[32];
+		uint8_t *dst = last ? tail : o;
+		__m128i low = _mm256_castsi256_si128(v);
+		__m128i high = _mm256_extracti128_si256(v, 1);
+		unsigned keep = ~drop;
+		uint8_t *d = squeeze(dst, low, keep, 0);
+		d = squeeze(d, low, keep>>8, 8);
+		d = squeeze(d, high, keep>>16, 0);
+		d = squeeze(d, high, keep>>24, 8);
+		if(last)
+			memcpy(o, tail, d-tail);
+		o += d-dst;
+	}
+
+	_mm256_zeroupper();
+	return o-out;
+}
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Netascii translation, which turns each LF into CR LF and each bare CR into CR NUL on the way out, and back again on the way in.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTP_ASCII_H
+#define TFTP_ASCII_H
+
+#include "tftp_protoc.h"
+
+// One implementation of the translations, suited to some instruction set:
+struct asciikernel
+{
+	const char *name;
+	size_t (*enc)(const uint8_t *, size_t, uint8_t *);
+	size_t (*dec)(const uint8_t *, size_t, uint8_t *, bool *);
+};
+
+const struct asciikernel *asciikernels(void);
+size_t asciienc(const uint8_t *, size_t, uint8_t *);
+size_t asciidec(const uint8_t *, size_t, uint8_t *, bool *);
+off_t asciisize(int);
+
+#endif
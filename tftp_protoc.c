@@ -17,21 +17,60 @@
 // Simple TFTP protocol library implementation.
 // Author: Sol Boucher <slb1566@rit.edu>
 
+#define _GNU_SOURCE
 #include "tftp_protoc.h"
+#include "tftp_uring.h"
+#include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/udp.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Room for the one control message we ever send or receive, which gives the segment size of coalesced datagrams:
+#define CTL_LEN CMSG_SPACE(sizeof(int))
+
+// Most datagrams, and bytes of them, the kernel will segment from one message:
+#define GSO_SEGS_MAX 64
+#define GSO_BYTES_MAX 65507
 
 const in_port_t PORT_PRIVILEGED = 69;
 const in_port_t PORT_UNPRIVILEGED = 1069;
 const size_t DATA_LEN = 512;
+const size_t BLKSIZE_MIN = 8;
+const size_t BLKSIZE_MAX = 65464;
+const size_t PKT_MAX = 65536;
+const unsigned BATCH_MAX = 32;
+const unsigned POOL_SIZE = 80;
 
 const uint16_t OPC_RRQ = 1;
 const uint16_t OPC_WRQ = 2;
 const uint16_t OPC_DAT = 3;
 const uint16_t OPC_ACK = 4;
 const uint16_t OPC_ERR = 5;
+const uint16_t OPC_OAK = 6;
 const char *const MODE_ASCII = "netascii";
 const char *const MODE_OCTET = "octet";
+const char *const OPT_BLKSIZE = "blksize";
+const unsigned OPTF_BLKSIZE = 0x1;
+const char *const OPT_WINDOWSIZE = "windowsize";
+const unsigned OPTF_WINDOWSIZE = 0x2;
+const unsigned WINDOWSIZE_MAX = 65535;
+const char *const OPT_TIMEOUT = "timeout";
+const unsigned OPTF_TIMEOUT = 0x4;
+const unsigned TIMEOUT_MAX = 255;
+const char *const OPT_MULTICAST = "multicast";
+const unsigned OPTF_MULTICAST = 0x8;
+const in_port_t PORT_MULTICAST = 1758;
+const char *const OPT_TSIZE = "tsize";
+const unsigned OPTF_TSIZE = 0x10;
+const char *const OPT_ROLLOVER = "rollover";
+const unsigned OPTF_ROLLOVER = 0x20;
+const size_t OPTS_MAXLEN = 512;
 const uint16_t ERR_UNKNOWN = 0;
 const uint16_t ERR_NOTFOUND = 1;
 const uint16_t ERR_ACCESSDENIED = 2;
@@ -40,16 +79,68 @@ const uint16_t ERR_ILLEGALOPER = 4;
 const uint16_t ERR_UNKNOWNTID = 5;
 const uint16_t ERR_CLOBBER = 6;
 const uint16_t ERR_UNKNOWNUSER = 7;
+const uint16_t ERR_BADOPTS = 8;
+const char *const MSG_BUSY = "Server busy";
+
+// This thread's fixed supply of PKT_MAX-byte buffers, which are recycled without touching the heap, and the memory they're carved from:
+static __thread void **pool;
+static __thread unsigned pool_free;
+static __thread uint8_t *slab;
+
+// Outgoing datagrams accumulated by this thread, and how many callers have asked to hold them:
+static __thread struct pktbatch outbox;
+static __thread unsigned corks;
+
+// This thread's ring for sending them, if it asked for one, and the socket each is to go out on:
+static __thread struct uring *ring;
+static __thread int *outfds;
+
+// The messages actually handed to the kernel, each covering one or more queued datagrams starting at the corresponding index:
+static __thread struct mmsghdr *wire;
+static __thread unsigned *wirefrom;
+
+// Whether the kernel will segment runs of datagrams for us (UDP GSO): 1 if so, -1 if not, or 0 if we haven't checked:
+static __thread int gso;
+
+// Whether to keep to one datagram per system call in each direction (no GSO or GRO), as for comparison:
+static bool unbundled;
+
+// Arranges for each thread's share of the above to be released when it exits:
+static pthread_key_t owner;
+static pthread_once_t owning = PTHREAD_ONCE_INIT;
+
+// Whether we've already warned that the kernel won't grow socket buffers enough:
+static bool capped;
+
+static void claim(void);
+static void makeowner(void);
+static void release(void *);
+static unsigned gather(unsigned);
+static void flushring(void);
+static void unring(void);
+static unsigned splitgro(struct pktbatch *, unsigned);
+static void linkslot(struct pktbatch *, unsigned, void *);
+static void fitbuf(int, int, int);
 
 // Opens a UDP socket and binds it to the specified port.
 // Accepts: port number or 0 to choose an arbitrary ephemeral port
 // Returns: file descriptor or -1 in case of an error
 int openudp(uint16_t port)
+{
+	return openudpr(port, 0);
+}
+
+// Opens a UDP socket and binds it to the specified port, which may be shared with other sockets that ask to reuse it.  The kernel then spreads incoming datagrams among them, keeping each remote address and port on the same one.
+// Accepts: port number or 0 to choose an arbitrary ephemeral port, whether to allow reuse
+// Returns: file descriptor or -1 in case of an error
+int openudpr(uint16_t port, bool reuse)
 {
 	// Open UDP socket over IP:
 	int socketfd;
 	if((socketfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
 		handle_error("socket()");
+	if(reuse && setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse))
+		handle_error("setsockopt()");
 
 	// Bind to interface port:
 	struct sockaddr_in saddr_local;
@@ -57,111 +148,782 @@ int openudp(uint16_t port)
 	saddr_local.sin_port = htons(port);
 	saddr_local.sin_addr.s_addr = INADDR_ANY;
 	if(bind(socketfd, (struct sockaddr *)&saddr_local, sizeof saddr_local))
+	{
+		close(socketfd);
 		return -1;
+	}
 
 	return socketfd;
 }
 
+// Opens a UDP socket that receives a multicast group's datagrams, even if other sockets on this host already do.
+// Accepts: the group's address and port, the local interface on which to join it
+// Returns: file descriptor or -1 in case of an error
+int openmcast(const struct sockaddr_in *group, struct in_addr iface)
+{
+	int socketfd;
+	if((socketfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		handle_error("socket()");
+	bool yes = 1;
+	bool no = 0;
+	setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+	setsockopt(socketfd, IPPROTO_IP, IP_MULTICAST_ALL, &no, sizeof no);
+
+	// Bind to the group itself, so we don't also hear unicast traffic to the same port:
+	struct ip_mreq join = {group->sin_addr, iface};
+	if(bind(socketfd, (struct sockaddr *)group, sizeof *group) || setsockopt(socketfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof join))
+	{
+		close(socketfd);
+		return -1;
+	}
+
+	return socketfd;
+}
+
+// Directs a socket's multicast datagrams out a particular interface.
+// Accepts: socket file descriptor, the local interface's address
+void mcastvia(int sfd, struct in_addr iface)
+{
+	setsockopt(sfd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof iface);
+}
+
+// Determines the local address from which we'd reach a peer, and thus the interface that shares a network with it.
+// Accepts: the peer's address
+// Returns: our address, or INADDR_ANY if there's no route
+struct in_addr localaddr(const struct sockaddr_in *peer)
+{
+	struct sockaddr_in local;
+	local.sin_addr.s_addr = INADDR_ANY;
+	socklen_t local_len = sizeof local;
+
+	// Connecting a datagram socket sends nothing, but does pick its source address:
+	int probe = socket(AF_INET, SOCK_DGRAM, 0);
+	if(probe >= 0 && !connect(probe, (struct sockaddr *)peer, sizeof *peer))
+		getsockname(probe, (struct sockaddr *)&local, &local_len);
+	if(probe >= 0)
+		close(probe);
+	return local.sin_addr;
+}
+
 // Listens for a datagram arriving on the specified socket.
-// Accepts: socket file descriptor
-// Returns: caller-owned buffer
-void *recvpkt(int sfd)
+// Accepts: socket file descriptor, buffer of at least PKT_MAX bytes
+// Returns: its length, or 0 if the datagram was empty or a nonblocking socket had none waiting
+size_t recvpkt(int sfd, void *buf)
 {
-	return recvpkta(sfd, NULL);
+	return recvpkta(sfd, buf, NULL);
 }
 
 // Listens on socket for incoming datagram and reveals its source address.
-// Accepts: file descriptor, pointer to socket address structure or NULL
-// Returns: caller-owned buffer
-void *recvpkta(int sfd, struct sockaddr_in *rmt_saddr)
+// Accepts: file descriptor, buffer of at least PKT_MAX bytes, pointer to socket address structure or NULL
+// Returns: its length, or 0 if the datagram was empty or a nonblocking socket had none waiting
+size_t recvpkta(int sfd, void *buf, struct sockaddr_in *rmt_saddr)
 {
-	recvpktal(sfd, NULL, rmt_saddr);
+	// View the caller's buffer as a batch of one:
+	struct mmsghdr hdr;
+	struct iovec iov;
+	struct sockaddr_in addr;
+	struct pktbatch one = {0, 1, -1, &hdr, &iov, &addr};
+	linkslot(&one, 0, buf);
+
+	if(!recvbatch(sfd, &one, 1))
+		return 0;
+	if(rmt_saddr)
+		*rmt_saddr = addr;
+	return batchlen(&one, 0);
 }
 
-// Listens on socket for incoming datagram and reveals its length and source address.
-// Accepts: file descriptor, pointer to length or NULL, pointer to address or NULL
-// Returns: caller-owned buffer
-void *recvpktal(int sfd, size_t *len_out, struct sockaddr_in *rmt_saddr)
+// Borrows a buffer from this thread's pool, which is set up on first use.
+// Returns: a buffer of PKT_MAX bytes, or NULL with errno set if the pool couldn't be set up or has run dry
+void *pktget(void)
 {
-	ssize_t msg_len;
-	socklen_t rsaddr_len = sizeof(struct sockaddr_in);
-
-	// Listen for an incoming message and note its length:
-	if((msg_len = recvfrom(sfd, NULL, 0, MSG_TRUNC|MSG_PEEK, (struct sockaddr *)rmt_saddr, rmt_saddr ? &rsaddr_len : NULL)) < 0)
-		handle_error("recvfrom()");
+	if(!pool)
+	{
+		claim();
+		slab = malloc(POOL_SIZE*PKT_MAX);
+		pool = malloc(POOL_SIZE*sizeof *pool);
+		if(!slab || !pool)
+		{
+			free(slab);
+			free(pool);
+			slab = NULL;
+			pool = NULL;
+			errno = ENOMEM;
+			return NULL;
+		}
+		for(pool_free = 0; pool_free < POOL_SIZE; ++pool_free)
+			pool[pool_free] = slab+pool_free*PKT_MAX;
+	}
 
-	// Check whether remote terminated the connection:
-	if(msg_len == 0)
+	// Running dry means someone is leaking buffers:
+	if(!pool_free)
+	{
+		errno = ENOBUFS;
 		return NULL;
+	}
+	return pool[--pool_free];
+}
+
+// Returns a buffer to this thread's pool.
+// Accepts: a buffer obtained from pktget() on the same thread
+void pktput(void *buf)
+{
+	pool[pool_free++] = buf;
+}
+
+// Sets up a batch of datagrams, with buffers borrowed from this thread's pool.  If the pool runs short, it holds fewer.
+// Accepts: the batch, how many datagrams it should hold
+// Returns: whether it holds any at all, or else errno is set
+bool batchinit(struct pktbatch *batch, unsigned cap)
+{
+	batch->count = 0;
+	batch->cap = cap;
+	batch->sfd = -1;
+	batch->hdrs = calloc(cap, sizeof *batch->hdrs);
+	batch->iovs = calloc(cap, sizeof *batch->iovs);
+	batch->addrs = calloc(cap, sizeof *batch->addrs);
+	batch->ctls = calloc(cap, CTL_LEN);
+	batch->segs = NULL;
+	batch->segcap = 0;
+	batch->split = 0;
+
+	unsigned index = 0;
+	void *buf;
+	if(batch->hdrs && batch->iovs && batch->addrs && batch->ctls)
+		for(; index < cap && (buf = pktget()); ++index)
+			linkslot(batch, index, buf);
+	else
+		errno = ENOMEM;
+	batch->cap = index;
+	if(!index)
+	{
+		batchfree(batch);
+		return 0;
+	}
+	return 1;
+}
 
-	// Read the message:
-	void *msg = malloc(msg_len);
-	if(recv(sfd, msg, msg_len, 0) <= 0)
-		handle_error("recv()");
+// Releases a batch, returning its buffers to this thread's pool.
+// Accepts: the batch
+void batchfree(struct pktbatch *batch)
+{
+	unsigned index;
+	for(index = 0; index < batch->cap; ++index)
+		pktput(batch->iovs[index].iov_base);
+	free(batch->hdrs);
+	free(batch->iovs);
+	free(batch->addrs);
+	free(batch->ctls);
+	free(batch->segs);
+	batch->cap = 0;
+}
+
+// Receives as many waiting datagrams as will fit with a single system call, blocking for the first only if the socket does.  If the socket has been set up with pktgro(), there may be more of them than the batch has slots.
+// Accepts: socket file descriptor, the batch to overwrite, most datagrams to accept
+// Returns: how many arrived
+unsigned recvbatch(int sfd, struct pktbatch *batch, unsigned max)
+{
+	if(max > batch->cap)
+		max = batch->cap;
 
-	if(len_out)
-		*len_out = msg_len;
-	return msg;
+	unsigned index;
+	for(index = 0; index < max; ++index)
+	{
+		batch->iovs[index].iov_len = PKT_MAX;
+		batch->hdrs[index].msg_hdr.msg_namelen = sizeof *batch->addrs;
+		batch->hdrs[index].msg_hdr.msg_control = batch->ctls ? batch->ctls+index*CTL_LEN : NULL;
+		batch->hdrs[index].msg_hdr.msg_controllen = batch->ctls ? CTL_LEN : 0;
+	}
+
+	int count;
+	while((count = recvmmsg(sfd, batch->hdrs, max, MSG_WAITFORONE, NULL)) < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			count = 0;
+			break;
+		}
+		if(errno != EINTR)
+			handle_error("recvmmsg()");
+	}
+
+	batch->count = count;
+	batch->split = 0;
+	return batch->ctls ? splitgro(batch, count) : count;
 }
 
-// Sends a file over a network socket.
-// Accepts: socket file descriptor, file descriptor, pointer to destination address
-void sendfile(int sfd, int fd, struct sockaddr_in *dest)
+// Locates the buffer of a datagram in a batch.
+// Accepts: the batch, the datagram's index
+// Returns: the buffer
+void *batchbuf(const struct pktbatch *batch, unsigned index)
 {
-	uint16_t buf[4+DATA_LEN];
-	buf[0] = OPC_DAT;
-	buf[1] = 0; // Block ID
-	int len = DATA_LEN;
+	return batch->split ? batch->segs[index].buf : batch->iovs[index].iov_base;
+}
 
-	for(buf[1] = 0; len == DATA_LEN; ++buf[1])
+// Measures a received datagram.
+// Accepts: the batch, the datagram's index
+// Returns: its length in bytes
+size_t batchlen(const struct pktbatch *batch, unsigned index)
+{
+	return batch->split ? batch->segs[index].len : batch->hdrs[index].msg_len;
+}
+
+// Reveals the source of a received datagram.
+// Accepts: the batch, the datagram's index
+// Returns: its address
+struct sockaddr_in *batchaddr(const struct pktbatch *batch, unsigned index)
+{
+	return batch->split ? batch->segs[index].addr : batch->addrs+index;
+}
+
+// Reserves space for an outgoing datagram, which stays queued until pktcommit() if we're corked.  Queued datagrams for any other socket are sent first.
+// Accepts: socket file descriptor, destination address
+// Returns: a buffer of PKT_MAX bytes for the datagram, or NULL if there's no memory to send it from, in which case it should be dropped without calling pktcommit()
+void *pktslot(int sfd, const struct sockaddr_in *dest)
+{
+	if(!outbox.cap)
 	{
-		len = read(fd, buf+2, DATA_LEN);
-		sendto(sfd, buf, 4+len, 0, (struct sockaddr *)dest, sizeof(struct sockaddr_in));
+		claim();
+		if(!wire)
+			wire = calloc(BATCH_MAX, sizeof *wire);
+		if(!wirefrom)
+			wirefrom = calloc(BATCH_MAX, sizeof *wirefrom);
+		if(!wire || !wirefrom || !batchinit(&outbox, BATCH_MAX))
+			return NULL;
+	}
+	if(outbox.count && (outbox.count == outbox.cap || (!ring && outbox.sfd != sfd)))
+		flushpkts();
 
-		// Make sure something (hopefully an ACK) arrives:
-		uint16_t *resp = recvpkt(sfd);
-		free(resp);
+	outbox.sfd = sfd;
+	if(ring)
+		outfds[outbox.count] = sfd;
+	outbox.addrs[outbox.count] = *dest;
+	return batchbuf(&outbox, outbox.count);
+}
+
+// Finalizes the datagram most recently reserved with pktslot(), sending it right away unless we're corked.
+// Accepts: its length in bytes
+void pktcommit(size_t len)
+{
+	outbox.iovs[outbox.count++].iov_len = len;
+	if(!corks)
+		flushpkts();
+}
+
+// Holds outgoing datagrams until a matching pktuncork(), so they can all go out together.  Calls may be nested.
+void pktcork(void)
+{
+	++corks;
+}
+
+// Releases a pktcork(), sending everything queued if it was the outermost.
+void pktuncork(void)
+{
+	if(!--corks)
+		flushpkts();
+}
+
+// Sends every queued datagram with as few system calls as possible.  Any the socket can't currently accommodate are dropped, leaving it to retransmission to make up for them.
+void flushpkts(void)
+{
+	if(ring && outbox.count)
+	{
+		flushring();
+		return;
+	}
+
+	unsigned sent = 0;
+	unsigned count = gather(0);
+	while(sent < count)
+	{
+		int res = sendmmsg(outbox.sfd, wire+sent, count-sent, 0);
+		if(res < 0 && errno == EINTR)
+			continue;
+
+		// Not every device can checksum segments for us, so give up on asking and start over from the one that failed:
+		if(res < 0 && errno == EIO && wire[sent].msg_hdr.msg_iovlen > 1)
+		{
+			gso = -1;
+			count = gather(wirefrom[sent]);
+			sent = 0;
+			continue;
+		}
+		if(res <= 0)
+			break;
+		sent += res;
+	}
+	outbox.count = 0;
+}
+
+// Groups the queued datagrams into as few messages as possible, by having the kernel segment each run of equal-sized ones bound for the same place (UDP GSO).  The last in a run may be shorter, as at the end of a file.
+// Accepts: index of the first queued datagram to include
+// Returns: how many messages are ready in the wire array
+unsigned gather(unsigned first)
+{
+	if(!gso)
+	{
+		int size;
+		socklen_t size_len = sizeof size;
+		gso = unbundled || getsockopt(outbox.sfd, SOL_UDP, UDP_SEGMENT, &size, &size_len) ? -1 : 1;
+	}
+
+	unsigned count = 0;
+	unsigned index = first;
+	while(index < outbox.count)
+	{
+		struct msghdr *msg = &wire[count].msg_hdr;
+		*msg = outbox.hdrs[index].msg_hdr;
+		wirefrom[count] = index;
+
+		size_t seg = outbox.iovs[index].iov_len;
+		size_t total = seg;
+		unsigned run = 1;
+		while(gso > 0 && index+run < outbox.count && run < GSO_SEGS_MAX && seg)
+		{
+			unsigned next = index+run;
+			size_t len = outbox.iovs[next].iov_len;
+			if(outbox.iovs[next-1].iov_len != seg || len > seg || total+len > GSO_BYTES_MAX || (ring && outfds[next] != outfds[index]) ||
+					outbox.addrs[next].sin_addr.s_addr != outbox.addrs[index].sin_addr.s_addr || outbox.addrs[next].sin_port != outbox.addrs[index].sin_port)
+				break;
+			total += len;
+			++run;
+		}
+
+		// The iovecs are contiguous, so the run's can be passed as is:
+		msg->msg_iovlen = run;
+		msg->msg_control = NULL;
+		msg->msg_controllen = 0;
+		if(run > 1)
+		{
+			msg->msg_control = outbox.ctls+count*CTL_LEN;
+			msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *)CMSG_DATA(cmsg) = seg;
+		}
+		index += run;
+		++count;
 	}
+	return count;
 }
 
-// Receives a file over a network socket.
-// Accepts: socket file descriptor, file descriptor
-// Returns: NULL or a human-readable error message
-const char *recvfile(int sfd, int fd)
+// Switches this thread to sending through an io_uring, so that datagrams queued for any number of sockets go out with a single system call.
+// Returns: whether the kernel supports it; if not, sendmmsg() remains in use
+bool pktring(void)
 {
-	size_t msg_len;
-	struct sockaddr_in rsa;
+	if(ring)
+		return 1;
 
-	do
+	struct uring *r = malloc(sizeof *r);
+	int *fds = calloc(BATCH_MAX, sizeof *fds);
+	if(!r || !fds || !uringinit(r, BATCH_MAX))
 	{
-		uint16_t *inc = recvpktal(sfd, &msg_len, &rsa);
+		free(r);
+		free(fds);
+		return 0;
+	}
+	claim();
+	ring = r;
+	outfds = fds;
+	return 1;
+}
+
+// Notes that this thread holds buffers or a ring, which must be released when it exits.
+void claim(void)
+{
+	pthread_once(&owning, &makeowner);
+	pthread_setspecific(owner, &owner);
+}
 
-		if(iserr(inc))
+// Creates the key whose destructor releases each exiting thread's share.
+void makeowner(void)
+{
+	if(pthread_key_create(&owner, &release))
+		handle_error("pthread_key_create()");
+}
+
+// Releases everything an exiting thread set up for sending and receiving.  Any datagrams it left queued are sent first.
+// Accepts: the key's value, which doesn't matter
+void release(void *unused)
+{
+	if(outbox.count)
+		flushpkts();
+	if(ring)
+		unring();
+	if(outbox.cap)
+		batchfree(&outbox);
+	free(wire);
+	free(wirefrom);
+	wire = NULL;
+	wirefrom = NULL;
+	free(pool);
+	free(slab);
+	pool = NULL;
+	slab = NULL;
+}
+
+// Sends every queued datagram through this thread's ring, waiting until the kernel is done with their buffers.  As with sendmmsg(), any a socket can't currently accommodate are dropped.  Should the ring itself fail, the thread goes back to sendmmsg() for good, starting with whatever the ring didn't take.
+void flushring(void)
+{
+	unsigned count = gather(0);
+	unsigned index;
+	for(index = 0; index < count; ++index)
+	{
+		struct io_uring_sqe *sqe = uringsqe(ring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = outfds[wirefrom[index]];
+		sqe->addr = (unsigned long)&wire[index].msg_hdr;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_DONTWAIT;
+	}
+	if(!uringsubmit(ring, count))
+	{
+		unsigned sent;
+		for(sent = count-uringunsent(ring); sent < count;)
 		{
-			const char *desc = strerr(inc);
-			free(inc);
-			return desc;
+			int sfd = outfds[wirefrom[sent]];
+			unsigned run = 1;
+			while(sent+run < count && outfds[wirefrom[sent+run]] == sfd)
+				++run;
+			sendmmsg(sfd, wire+sent, run, 0);
+			sent += run;
 		}
+		unring();
+		outbox.count = 0;
+		return;
+	}
 
-		if(msg_len > 4)
-			write(fd, inc+2, msg_len-4);
-		sendack(sfd, inc[1], &rsa);
+	// Those are already lost if the device couldn't segment them, but at least don't ask it to again:
+	struct io_uring_cqe cqe;
+	while(uringreap(ring, &cqe))
+		if(cqe.res == -EIO)
+			gso = -1;
+	outbox.count = 0;
+}
+
+// Stops sending through this thread's ring and releases it.
+void unring(void)
+{
+	uringfree(ring);
+	free(ring);
+	free(outfds);
+	ring = NULL;
+	outfds = NULL;
+}
+
+// Lets the kernel coalesce bursts of datagrams arriving on a socket (UDP GRO), which recvbatch() then splits back apart.  Sockets read any other way must not use this.
+// Accepts: socket file descriptor
+// Returns: whether the kernel supports it
+bool pktgro(int sfd)
+{
+	int on = 1;
+	return !unbundled && !setsockopt(sfd, SOL_UDP, UDP_GRO, &on, sizeof on);
+}
+
+// Stops every thread from using segmentation offload in either direction, even where the kernel supports it.  Must be called before any datagrams are sent.
+void pktnooffload(void)
+{
+	unbundled = 1;
+}
+
+// Finds any received datagrams that the kernel coalesced, and lists every one of the originals separately if so.
+// Accepts: the batch, how many (possibly coalesced) datagrams were received into it
+// Returns: how many datagrams that amounts to
+unsigned splitgro(struct pktbatch *batch, unsigned count)
+{
+	size_t sizes[count];
+	unsigned total = 0;
+	unsigned index;
+	for(index = 0; index < count; ++index)
+	{
+		struct msghdr *msg = &batch->hdrs[index].msg_hdr;
+		size_t len = batch->hdrs[index].msg_len;
+		sizes[index] = len;
 
-		free(inc);
+		struct cmsghdr *cmsg;
+		for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+			if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				sizes[index] = *(int *)CMSG_DATA(cmsg);
+		total += len && sizes[index] < len ? (len+sizes[index]-1)/sizes[index] : 1;
 	}
-	while(msg_len == 4+DATA_LEN);
+	if(total == count)
+		return count;
 
-	return NULL;
+	if(total > batch->segcap)
+	{
+		batch->segcap = total;
+		batch->segs = realloc(batch->segs, total*sizeof *batch->segs);
+	}
+	unsigned seg = 0;
+	for(index = 0; index < count; ++index)
+	{
+		size_t left = batch->hdrs[index].msg_len;
+		uint8_t *buf = batch->iovs[index].iov_base;
+		do
+		{
+			size_t len = left < sizes[index] ? left : sizes[index];
+			batch->segs[seg].buf = buf;
+			batch->segs[seg].len = len;
+			batch->segs[seg].addr = batch->addrs+index;
+			++seg;
+			buf += len;
+			left -= len;
+		}
+		while(left);
+	}
+	batch->split = 1;
+	return total;
+}
+
+// Points one of a batch's slots at a buffer.
+// Accepts: the batch, the slot's index, a buffer of PKT_MAX bytes
+void linkslot(struct pktbatch *batch, unsigned index, void *buf)
+{
+	batch->iovs[index].iov_base = buf;
+	batch->iovs[index].iov_len = PKT_MAX;
+	batch->hdrs[index].msg_hdr.msg_name = batch->addrs+index;
+	batch->hdrs[index].msg_hdr.msg_namelen = sizeof *batch->addrs;
+	batch->hdrs[index].msg_hdr.msg_iov = batch->iovs+index;
+	batch->hdrs[index].msg_hdr.msg_iovlen = 1;
 }
 
 // Acknowledges receipt of a block of the caller's choice.
 // Accepts: socket file descriptor, block number, pointer to destination
 void sendack(int sfd, uint16_t blknum, struct sockaddr_in *dest)
 {
-	uint16_t ack[2];
-	ack[0] = OPC_ACK;
-	ack[1] = blknum;
-	sendto(sfd, ack, sizeof ack, 0, (struct sockaddr *)dest, sizeof(struct sockaddr_in));
+	uint16_t *ack = pktslot(sfd, dest);
+	if(!ack)
+		return;
+	ack[0] = htons(OPC_ACK);
+	ack[1] = htons(blknum);
+	pktcommit(4);
+}
+
+// Grows a socket's kernel buffers to hold an entire window (plus the kernel's per-datagram overhead), so that a burst of blocks isn't dropped on arrival.  The kernel may cap the sizes, in which case the sender will have to retransmit more.
+// Accepts: socket file descriptor, negotiated options
+void fitwindow(int sfd, const struct xferopts *opts)
+{
+	size_t need = 2*(size_t) opts->windowsize*(4+opts->blksize);
+	int want = need < INT_MAX ? need : INT_MAX;
+
+	fitbuf(sfd, SO_RCVBUF, want);
+	fitbuf(sfd, SO_SNDBUF, want);
+}
+
+// Grows one of a socket's kernel buffers, warning the first time the kernel won't grant as much as we asked for.
+// Accepts: socket file descriptor, SO_RCVBUF or SO_SNDBUF, desired size in bytes
+void fitbuf(int sfd, int which, int want)
+{
+	int have;
+	socklen_t have_len = sizeof have;
+
+	if(getsockopt(sfd, SOL_SOCKET, which, &have, &have_len) || have >= want)
+		return;
+	setsockopt(sfd, SOL_SOCKET, which, &want, sizeof want);
+	have_len = sizeof have;
+	if(!getsockopt(sfd, SOL_SOCKET, which, &have, &have_len) && have < want && !__atomic_exchange_n(&capped, 1, __ATOMIC_RELAXED))
+		fprintf(stderr, "Kernel capped socket %s buffer at %d bytes, short of the %d asked for\n", which == SO_RCVBUF ? "receive" : "send", have, want);
+}
+
+// Resets transfer options to the protocol defaults, with none marked as requested.
+// Accepts: the options to reset
+void initopts(struct xferopts *opts)
+{
+	opts->present = 0;
+	opts->blksize = DATA_LEN;
+	opts->windowsize = 1;
+	opts->timeout = 0;
+	memset(&opts->group, 0, sizeof opts->group);
+	opts->master = 0;
+	opts->tsize = 0;
+	opts->rollover = 0;
+	opts->netascii = 0;
+}
+
+// Parses a list of null-terminated option name and value pairs, as found at the end of requests and in OACKs.  Unrecognized options and nonsensical values are skipped.
+// Accepts: beginning of the list, its length in bytes, options to update
+// Returns: whether the list was well-formed
+bool parseopts(const void *list, size_t len, struct xferopts *opts)
+{
+	const char *name = list;
+	const char *end = name+len;
+
+	while(name < end)
+	{
+		const char *value = memchr(name, '\0', end-name);
+		if(!value)
+			return 0;
+		++value;
+		if(!memchr(value, '\0', end-value))
+			return 0;
+
+		if(strcasecmp(name, OPT_BLKSIZE) == 0)
+		{
+			char *unparsed;
+			unsigned long blksize = strtoul(value, &unparsed, 10);
+			if(!*unparsed && blksize >= BLKSIZE_MIN && blksize <= BLKSIZE_MAX)
+			{
+				opts->present |= OPTF_BLKSIZE;
+				opts->blksize = blksize;
+			}
+		}
+		else if(strcasecmp(name, OPT_WINDOWSIZE) == 0)
+		{
+			char *unparsed;
+			unsigned long windowsize = strtoul(value, &unparsed, 10);
+			if(!*unparsed && windowsize >= 1 && windowsize <= WINDOWSIZE_MAX)
+			{
+				opts->present |= OPTF_WINDOWSIZE;
+				opts->windowsize = windowsize;
+			}
+		}
+		else if(strcasecmp(name, OPT_TIMEOUT) == 0)
+		{
+			char *unparsed;
+			unsigned long timeout = strtoul(value, &unparsed, 10);
+			if(!*unparsed && timeout >= 1 && timeout <= TIMEOUT_MAX)
+			{
+				opts->present |= OPTF_TIMEOUT;
+				opts->timeout = timeout;
+			}
+		}
+		else if(strcasecmp(name, OPT_TSIZE) == 0)
+		{
+			char *unparsed;
+			unsigned long long tsize = strtoull(value, &unparsed, 10);
+			if(*value >= '0' && *value <= '9' && !*unparsed)
+			{
+				opts->present |= OPTF_TSIZE;
+				opts->tsize = tsize;
+			}
+		}
+		else if(strcasecmp(name, OPT_ROLLOVER) == 0)
+		{
+			if(strcmp(value, "0") == 0 || strcmp(value, "1") == 0)
+			{
+				opts->present |= OPTF_ROLLOVER;
+				opts->rollover = *value-'0';
+			}
+		}
+		else if(strcasecmp(name, OPT_MULTICAST) == 0)
+		{
+			// Clients ask with an empty value, and servers answer with the group and whether the recipient is its master:
+			char addr[INET_ADDRSTRLEN];
+			unsigned short port;
+			int master;
+			int used = 0;
+			if(!*value)
+			{
+				opts->present |= OPTF_MULTICAST;
+				memset(&opts->group, 0, sizeof opts->group);
+			}
+			else if(sscanf(value, "%15[0-9.],%hu,%d%n", addr, &port, &master, &used) == 3 && !value[used] && port && (master == 0 || master == 1) && inet_pton(AF_INET, addr, &opts->group.sin_addr) == 1 && IN_MULTICAST(ntohl(opts->group.sin_addr.s_addr)))
+			{
+				opts->present |= OPTF_MULTICAST;
+				opts->group.sin_family = AF_INET;
+				opts->group.sin_port = htons(port);
+				opts->master = master;
+			}
+		}
+
+		name = value+strlen(value)+1;
+	}
+
+	return 1;
+}
+
+// Serializes those options marked as requested into a list of name and value pairs.
+// Accepts: a buffer of at least OPTS_MAXLEN bytes, the options
+// Returns: the number of bytes written
+size_t fmtopts(char *buf, const struct xferopts *opts)
+{
+	size_t len = 0;
+
+	if(opts->present & OPTF_BLKSIZE)
+	{
+		len += sprintf(buf+len, "%s", OPT_BLKSIZE)+1;
+		len += sprintf(buf+len, "%zu", opts->blksize)+1;
+	}
+	if(opts->present & OPTF_WINDOWSIZE)
+	{
+		len += sprintf(buf+len, "%s", OPT_WINDOWSIZE)+1;
+		len += sprintf(buf+len, "%u", opts->windowsize)+1;
+	}
+	if(opts->present & OPTF_TIMEOUT)
+	{
+		len += sprintf(buf+len, "%s", OPT_TIMEOUT)+1;
+		len += sprintf(buf+len, "%u", opts->timeout)+1;
+	}
+	if(opts->present & OPTF_TSIZE)
+	{
+		len += sprintf(buf+len, "%s", OPT_TSIZE)+1;
+		len += sprintf(buf+len, "%llu", (unsigned long long)opts->tsize)+1;
+	}
+	if(opts->present & OPTF_ROLLOVER)
+	{
+		len += sprintf(buf+len, "%s", OPT_ROLLOVER)+1;
+		len += sprintf(buf+len, "%u", opts->rollover)+1;
+	}
+	if(opts->present & OPTF_MULTICAST)
+	{
+		len += sprintf(buf+len, "%s", OPT_MULTICAST)+1;
+		if(opts->group.sin_port)
+		{
+			char addr[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &opts->group.sin_addr, addr, sizeof addr);
+			len += sprintf(buf+len, "%s,%hu,%d", addr, ntohs(opts->group.sin_port), opts->master != 0);
+		}
+		buf[len++] = '\0';
+	}
+
+	return len;
+}
+
+// Checks that the options granted by an OACK are no more ambitious than those we requested (and echo any timeout or rollover exactly, or assign any multicast group), and if so adopts them.
+// Accepts: the OACK packet, its length, requested options (updated to the negotiated ones)
+// Returns: whether the OACK was acceptable
+bool acceptoack(const void *oack, size_t len, struct xferopts *opts)
+{
+	struct xferopts granted;
+	initopts(&granted);
+	if(!parseopts(oack+2, len-2, &granted) || granted.present & ~opts->present || granted.blksize > opts->blksize || granted.windowsize > opts->windowsize || (granted.present & OPTF_TIMEOUT && granted.timeout != opts->timeout) || (granted.present & OPTF_ROLLOVER && granted.rollover != opts->rollover) || (granted.present & OPTF_MULTICAST && !granted.group.sin_port))
+		return 0;
+
+	granted.netascii = opts->netascii;
+	*opts = granted;
+	return 1;
+}
+
+// Builds a request datagram specifying the transfer mode and any requested options.  Unless it asks for larger blocks, it must fit in the 512 bytes RFC 1350 allows.
+// Accepts: a buffer, its size, requested filename, OPC_RRQ or OPC_WRQ, options
+// Returns: the request's length, or 0 if it didn't fit
+size_t fmtreq(void *buf, size_t size, const char *pathname, int opcode, const struct xferopts *opts)
+{
+	const char *mode = opts->netascii ? MODE_ASCII : MODE_OCTET;
+	size_t len = 2+strlen(pathname)+1+strlen(mode)+1;
+	if(len > size || size-len < OPTS_MAXLEN)
+		return 0;
+
+	char *req = buf;
+	*(uint16_t *)req = htons(opcode);
+	strcpy(req+2, pathname);
+	strcpy(req+2+strlen(pathname)+1, mode);
+	len += fmtopts(req+len, opts);
+	if(!(opts->present & OPTF_BLKSIZE) && len > DATA_LEN)
+		return 0;
+	return len;
+}
+
+// Acknowledges the options the server has agreed to honor.
+// Accepts: socket file descriptor, negotiated options, pointer to destination
+void sendoack(int sfd, const struct xferopts *opts, struct sockaddr_in *dest)
+{
+	uint8_t *oack = pktslot(sfd, dest);
+	if(!oack)
+		return;
+	*(uint16_t *)oack = htons(OPC_OAK);
+	pktcommit(2+fmtopts((char *)oack+2, opts));
 }
 
 // Sends an error datagram appropriate for the value of the errno variable.
@@ -193,11 +955,42 @@ void diagerrno(int sfd, struct sockaddr_in *dest)
 // Accepts: socket file descriptor, error code, pointer to destination
 void senderr(int sfd, uint16_t ercode, struct sockaddr_in *dest)
 {
-	uint8_t err[5];
-	*(uint16_t *)err = OPC_ERR;
-	*(uint16_t *)(err+2) = ercode;
+	uint8_t *err = pktslot(sfd, dest);
+	if(!err)
+		return;
+	*(uint16_t *)err = htons(OPC_ERR);
+	*(uint16_t *)(err+2) = htons(ercode);
 	err[4] = 0;
-	sendto(sfd, err, sizeof err, 0, (struct sockaddr *)dest, sizeof(struct sockaddr_in));
+	pktcommit(5);
+}
+
+// Turns away a request because the server is overloaded.  TFTP has no code for that, so it's spelled out.
+// Accepts: socket file descriptor, pointer to destination
+void sendbusy(int sfd, struct sockaddr_in *dest)
+{
+	uint8_t *err = pktslot(sfd, dest);
+	if(!err)
+		return;
+	*(uint16_t *)err = htons(OPC_ERR);
+	*(uint16_t *)(err+2) = htons(ERR_UNKNOWN);
+	strcpy((char *)err+4, MSG_BUSY);
+	pktcommit(5+strlen(MSG_BUSY));
+}
+
+// Extracts the opcode of a datagram.
+// Accepts: the packet
+// Returns: the opcode in host byte order
+uint16_t getopc(const void *payload)
+{
+	return ntohs(*(const uint16_t *)payload);
+}
+
+// Extracts the block number of a DATA or ACK datagram.
+// Accepts: the packet
+// Returns: the block number in host byte order
+uint16_t getblk(const void *payload)
+{
+	return ntohs(((const uint16_t *)payload)[1]);
 }
 
 // Determines whether the given datagram is an error response.
@@ -205,17 +998,23 @@ void senderr(int sfd, uint16_t ercode, struct sockaddr_in *dest)
 // Returns: the answer
 bool iserr(void *payload)
 {
-	return *(uint16_t *)payload == OPC_ERR;
+	return getopc(payload) == OPC_ERR;
 }
 
 // Converts an error datagram to a human-readable complaint.
-// Accepts: the packet
+// Accepts: the packet, its length
 // Returns: the demystification
-const char *strerr(void *payload)
+const char *strerr(void *payload, size_t len)
 {
-	uint16_t code = ((uint16_t *)payload)[1];
+	uint16_t code = getblk(payload);
 	if(code == ERR_UNKNOWN)
+	{
+		// The message needn't be terminated, so long as the packet ends right after it:
+		size_t busylen = strlen(MSG_BUSY);
+		if(len > 4 && len-4 >= busylen && !strncmp((char *)payload+4, MSG_BUSY, len-4 > busylen ? busylen+1 : busylen))
+			return MSG_BUSY;
 		return "Unknown error";
+	}
 	else if(code == ERR_NOTFOUND)
 		return "File not found";
 	else if(code == ERR_ACCESSDENIED)
@@ -230,6 +1029,8 @@ const char *strerr(void *payload)
 		return "File already exists";
 	else if(code == ERR_UNKNOWNUSER)
 		return "Unknown user";
+	else if(code == ERR_BADOPTS)
+		return "Option negotiation failed";
 	else
 		return "Inexcusable error";
 }
@@ -23,41 +23,131 @@
 #include <netinet/in.h>
 
 // Connection parameters:
-const in_port_t PORT_PRIVILEGED;
-const in_port_t PORT_UNPRIVILEGED;
-const size_t DATA_LEN;
+extern const in_port_t PORT_PRIVILEGED;
+extern const in_port_t PORT_UNPRIVILEGED;
+extern const size_t DATA_LEN;
+extern const size_t BLKSIZE_MIN;
+extern const size_t BLKSIZE_MAX;
+extern const size_t PKT_MAX;
+extern const unsigned BATCH_MAX;
+extern const unsigned POOL_SIZE;
 
 // Protocol details:
-const uint16_t OPC_RRQ;
-const uint16_t OPC_WRQ;
-const uint16_t OPC_DAT;
-const uint16_t OPC_ACK;
-const uint16_t OPC_ERR;
-const char *const MODE_ASCII;
-const char *const MODE_OCTET;
-const uint16_t ERR_UNKNOWN;
-const uint16_t ERR_NOTFOUND;
-const uint16_t ERR_ACCESSDENIED;
-const uint16_t ERR_DISKFULL;
-const uint16_t ERR_ILLEGALOPER;
-const uint16_t ERR_UNKNOWNTID;
-const uint16_t ERR_CLOBBER;
-const uint16_t ERR_UNKNOWNUSER;
+extern const uint16_t OPC_RRQ;
+extern const uint16_t OPC_WRQ;
+extern const uint16_t OPC_DAT;
+extern const uint16_t OPC_ACK;
+extern const uint16_t OPC_ERR;
+extern const uint16_t OPC_OAK;
+extern const char *const MODE_ASCII;
+extern const char *const MODE_OCTET;
+extern const char *const OPT_BLKSIZE;
+extern const unsigned OPTF_BLKSIZE;
+extern const char *const OPT_WINDOWSIZE;
+extern const unsigned OPTF_WINDOWSIZE;
+extern const unsigned WINDOWSIZE_MAX;
+extern const char *const OPT_TIMEOUT;
+extern const unsigned OPTF_TIMEOUT;
+extern const unsigned TIMEOUT_MAX;
+extern const char *const OPT_MULTICAST;
+extern const unsigned OPTF_MULTICAST;
+extern const in_port_t PORT_MULTICAST;
+extern const char *const OPT_TSIZE;
+extern const unsigned OPTF_TSIZE;
+extern const char *const OPT_ROLLOVER;
+extern const unsigned OPTF_ROLLOVER;
+extern const size_t OPTS_MAXLEN;
+extern const uint16_t ERR_UNKNOWN;
+extern const uint16_t ERR_NOTFOUND;
+extern const uint16_t ERR_ACCESSDENIED;
+extern const uint16_t ERR_DISKFULL;
+extern const uint16_t ERR_ILLEGALOPER;
+extern const uint16_t ERR_UNKNOWNTID;
+extern const uint16_t ERR_CLOBBER;
+extern const uint16_t ERR_UNKNOWNUSER;
+extern const uint16_t ERR_BADOPTS;
+
+// Explanation sent with ERR_UNKNOWN when the server turns a request away for want of room:
+extern const char *const MSG_BUSY;
 
 typedef int bool;
 
+// Transfer parameters that may be negotiated via RFC 2347 options, along with the request's mode:
+struct xferopts
+{
+	unsigned present; // Bitmask of the OPTF_* values named by the peer
+	size_t blksize;
+	unsigned windowsize;
+	unsigned timeout; // Seconds between retransmissions, or 0 to estimate them from round-trip times
+	struct sockaddr_in group; // Multicast group carrying the DATA, or a zero port if it's yet to be assigned
+	bool master; // Whether this client is the multicast group's master, and so the one that acknowledges
+	uint64_t tsize; // Size of the file in bytes, which a reader asks for by sending 0
+	unsigned rollover; // Block number that follows 65535, either 0 or 1
+	bool netascii; // Whether the file's line endings are translated on the wire, which is up to the request rather than an option
+};
+
+// One of several datagrams the kernel delivered coalesced into a single buffer:
+struct pktseg
+{
+	uint8_t *buf;
+	size_t len;
+	struct sockaddr_in *addr;
+};
+
+// Datagrams to be sent or received en masse, each with its own PKT_MAX-byte buffer and remote address:
+struct pktbatch
+{
+	unsigned count; // Datagrams currently held
+	unsigned cap; // Most datagrams it can hold
+	int sfd; // Socket on which queued datagrams are to be sent
+	struct mmsghdr *hdrs;
+	struct iovec *iovs; // Each points to its datagram's buffer
+	struct sockaddr_in *addrs;
+	uint8_t *ctls; // Room for each datagram's control messages, or NULL if they're of no interest
+	struct pktseg *segs; // Received datagrams split back apart, if any arrived coalesced
+	unsigned segcap;
+	bool split; // Whether the received datagrams are to be found in segs
+};
+
 // Utility functions:
 int openudp(uint16_t);
-void *recvpkt(int);
-void *recvpkta(int, struct sockaddr_in *);
-void *recvpktal(int, size_t *, struct sockaddr_in *);
-void sendfile(int, int, struct sockaddr_in *);
-const char *recvfile(int, int);
+int openudpr(uint16_t, bool);
+int openmcast(const struct sockaddr_in *, struct in_addr);
+void mcastvia(int, struct in_addr);
+struct in_addr localaddr(const struct sockaddr_in *);
+size_t recvpkt(int, void *);
+size_t recvpkta(int, void *, struct sockaddr_in *);
+void *pktget(void);
+void pktput(void *);
+bool batchinit(struct pktbatch *, unsigned);
+void batchfree(struct pktbatch *);
+unsigned recvbatch(int, struct pktbatch *, unsigned);
+void *batchbuf(const struct pktbatch *, unsigned);
+size_t batchlen(const struct pktbatch *, unsigned);
+struct sockaddr_in *batchaddr(const struct pktbatch *, unsigned);
+void *pktslot(int, const struct sockaddr_in *);
+void pktcommit(size_t);
+void pktcork(void);
+void pktuncork(void);
+void flushpkts(void);
+bool pktring(void);
+bool pktgro(int);
+void pktnooffload(void);
 void sendack(int, uint16_t, struct sockaddr_in *);
+void fitwindow(int, const struct xferopts *);
+void initopts(struct xferopts *);
+bool parseopts(const void *, size_t, struct xferopts *);
+size_t fmtopts(char *, const struct xferopts *);
+bool acceptoack(const void *, size_t, struct xferopts *);
+size_t fmtreq(void *, size_t, const char *, int, const struct xferopts *);
+void sendoack(int, const struct xferopts *, struct sockaddr_in *);
 void diagerrno(int, struct sockaddr_in *);
 void senderr(int, uint16_t, struct sockaddr_in *);
+void sendbusy(int, struct sockaddr_in *);
+uint16_t getopc(const void *);
+uint16_t getblk(const void *);
 bool iserr(void *);
-const char *strerr(void *);
+const char *strerr(void *, size_t);
 void handle_error(const char *);
 
 #endif
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Background writer implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#define _GNU_SOURCE
+#include "tftp_spool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+const size_t SPOOL_RING = 512*1024;
+const size_t SPOOL_CHUNK = 64*1024;
+
+// How many bytes may be written between syncs, or 0 to sync only once a file is complete:
+static uint64_t syncevery;
+
+// Files with work for the writer, in the order they asked:
+static struct spool *first;
+static struct spool *last;
+
+// Guards every spool's bookkeeping and the queue:
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+
+static void startwriter(void);
+static void *writer(void *);
+static void kick(struct spool *);
+static void finish(struct spool *);
+static void wake(struct spool *);
+static int writeout(const struct spool *, uint64_t, uint64_t);
+
+// Sets the durability policy for every file.
+// Accepts: how many bytes may be written between calls to fdatasync(), or 0 to sync only once a file is complete
+void spoolinit(uint64_t bytes)
+{
+	syncevery = bytes;
+}
+
+// Begins staging a file, starting the writer thread if this is the first.
+// Accepts: a file descriptor open for writing at its beginning
+// Returns: the spool, or NULL if there wasn't memory for it
+struct spool *spoolopen(int fd)
+{
+	pthread_once(&started, &startwriter);
+
+	struct spool *s = calloc(1, sizeof *s);
+	if(!s || !(s->ring = malloc(SPOOL_RING)) || (s->efd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		if(s)
+			free(s->ring);
+		free(s);
+		return NULL;
+	}
+	s->fd = fd;
+	pthread_cond_init(&s->idle, NULL);
+	return s;
+}
+
+// Appends to a file, handing each full chunk to the writer.  This never waits on the writer: if it can't keep up and the ring is full, the caller must hold on to the bytes (or have them sent again) until the eventfd says there's room.
+// Accepts: the spool, the bytes, how many
+// Returns: 1 if they were accepted, 0 if there's no room for them yet, or -1 with errno set if an earlier write failed
+int spoolwrite(struct spool *s, const void *buf, size_t len)
+{
+	pthread_mutex_lock(&lock);
+	if(s->error)
+	{
+		errno = s->error;
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	if(s->head+len-s->tail > SPOOL_RING)
+	{
+		s->starved = 1;
+		kick(s);
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	// The part of the ring past the head is ours, possibly wrapping around:
+	size_t at = s->head%SPOOL_RING;
+	size_t before = len < SPOOL_RING-at ? len : SPOOL_RING-at;
+	memcpy(s->ring+at, buf, before);
+	memcpy(s->ring, (const uint8_t *)buf+before, len-before);
+	s->head += len;
+	if(s->head/SPOOL_CHUNK != (s->head-len)/SPOOL_CHUNK)
+		kick(s);
+
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+// Declares a file complete, so that the writer will write out whatever remains and sync it.  Its eventfd becomes readable once that's done.
+// Accepts: the spool
+void spoolflush(struct spool *s)
+{
+	pthread_mutex_lock(&lock);
+	s->flushing = 1;
+	kick(s);
+	pthread_mutex_unlock(&lock);
+}
+
+// Checks whether the writer has done what was last asked of it, acknowledging any notification on the eventfd.
+// Accepts: the spool
+// Returns: 1 if the file is safely written (once a flush was requested) or there's room for a write that was turned away (before then), 0 if not yet, or -1 with errno set if a write failed
+int spooldone(struct spool *s)
+{
+	pthread_mutex_lock(&lock);
+	uint64_t count;
+	if(read(s->efd, &count, sizeof count) < 0)
+		count = 0;
+
+	int res = s->flushing ? s->flushed : !s->starved;
+	if(s->error)
+	{
+		errno = s->error;
+		res = -1;
+	}
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+// Stops staging a file, discarding anything not yet written.  This only waits if the writer is in the middle of a chunk of it; the file descriptor is left open.
+// Accepts: the spool
+void spoolclose(struct spool *s)
+{
+	pthread_mutex_lock(&lock);
+	while(s->busy)
+		pthread_cond_wait(&s->idle, &lock);
+	if(s->queued)
+	{
+		struct spool **link;
+		struct spool *prev = NULL;
+		for(link = &first; *link != s; link = &(*link)->next)
+			prev = *link;
+		*link = s->next;
+		if(last == s)
+			last = prev;
+	}
+	pthread_mutex_unlock(&lock);
+
+	pthread_cond_destroy(&s->idle);
+	close(s->efd);
+	free(s->ring);
+	free(s);
+}
+
+// Launches the writer thread, which runs as long as the program does.
+void startwriter(void)
+{
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, &writer, NULL))
+		handle_error("pthread_create()");
+	pthread_detach(thread);
+}
+
+// Writes out staged chunks as files fill them, along with the remainder of each file that's complete, syncing according to the policy.
+// Returns: never
+void *writer(void *unused)
+{
+	pthread_mutex_lock(&lock);
+	while(1)
+	{
+		while(!first)
+			pthread_cond_wait(&work, &lock);
+		struct spool *s = first;
+		if(!(first = s->next))
+			last = NULL;
+		s->queued = 0;
+
+		// Stick to whole chunks until the file is complete:
+		uint64_t begin = s->tail;
+		uint64_t end = s->flushing ? s->head : s->head/SPOOL_CHUNK*SPOOL_CHUNK;
+		bool final = s->flushing && !s->flushed;
+		if(s->error || (end <= begin && !final))
+		{
+			if(s->error && final)
+				finish(s);
+			else if(s->error && s->starved)
+				wake(s);
+			continue;
+		}
+		s->busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		int err = end > begin ? writeout(s, begin, end) : 0;
+		bool sync = !err && (final || (syncevery && end-s->synced >= syncevery));
+		if(sync && fdatasync(s->fd) && errno != EINVAL && errno != EROFS)
+			err = errno;
+
+		pthread_mutex_lock(&lock);
+		s->busy = 0;
+		s->tail = end;
+		if(sync)
+			s->synced = end;
+		if(err)
+			s->error = err;
+
+		// Say when everything is done (or never will be, even if the flush was asked for partway through a chunk), or come back for whatever has piled up (or a flush that was asked for) in the meantime:
+		if(s->starved && (err || end > begin))
+			wake(s);
+		if(s->flushing && !s->flushed && (err || (final && end == s->head)))
+			finish(s);
+		else if(!err && (s->flushing ? s->head > s->tail || !s->flushed : s->head/SPOOL_CHUNK*SPOOL_CHUNK > s->tail))
+			kick(s);
+		pthread_cond_broadcast(&s->idle);
+	}
+
+	return NULL;
+}
+
+// Queues a file for the writer, unless it's already waiting or being worked on.  The lock must be held.
+// Accepts: the spool
+void kick(struct spool *s)
+{
+	if(s->queued || s->busy)
+		return;
+
+	s->queued = 1;
+	s->next = NULL;
+	if(last)
+		last->next = s;
+	else
+		first = s;
+	last = s;
+	pthread_cond_signal(&work);
+}
+
+// Marks a flush as over, successful or not, and wakes whoever is waiting on it.  The lock must be held.
+// Accepts: the spool
+void finish(struct spool *s)
+{
+	s->flushed = 1;
+	wake(s);
+}
+
+// Makes a spool's eventfd readable, so whoever was waiting for room or a flush looks again.  The lock must be held.
+// Accepts: the spool
+void wake(struct spool *s)
+{
+	s->starved = 0;
+	uint64_t one = 1;
+	if(write(s->efd, &one, sizeof one) < 0 && !s->error)
+		s->error = errno;
+}
+
+// Writes part of a file from its ring, which may take two pieces if it wraps around.
+// Accepts: the spool, the file offsets to start and stop at
+// Returns: 0 or an errno value
+int writeout(const struct spool *s, uint64_t begin, uint64_t end)
+{
+	while(begin < end)
+	{
+		size_t at = begin%SPOOL_RING;
+		size_t len = end-begin;
+		struct iovec iov[2] = {{s->ring+at, len}, {s->ring, 0}};
+		if(at+len > SPOOL_RING)
+		{
+			iov[0].iov_len = SPOOL_RING-at;
+			iov[1].iov_len = len-iov[0].iov_len;
+		}
+
+		ssize_t res = pwritev(s->fd, iov, 2, begin);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res < 0)
+			return errno;
+		if(!res)
+			return ENOSPC;
+		begin += res;
+	}
+	return 0;
+}
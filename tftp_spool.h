@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Staging area for received files, which a background thread writes out in large chunks so the network never waits on the disk.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTP_SPOOL_H
+#define TFTP_SPOOL_H
+
+#include "tftp_protoc.h"
+#include <pthread.h>
+
+// Bytes staged for each file, and the granularity in which they're written:
+extern const size_t SPOOL_RING;
+extern const size_t SPOOL_CHUNK;
+
+// A file being written sequentially from the beginning:
+struct spool
+{
+	int fd; // The file
+	int efd; // Eventfd that becomes readable once a requested flush is done, or once there's room for a write that was turned away
+	uint8_t *ring; // Staged contents, in a circular buffer of SPOOL_RING bytes
+	uint64_t head; // Bytes of the file staged so far
+	uint64_t tail; // Bytes of the file written so far
+	uint64_t synced; // Bytes of the file known to be durable
+	int error; // errno from the first failed write or sync, or 0
+	bool flushing; // Whether the file is complete, so everything staged should be written and synced
+	bool flushed; // Whether that's happened
+	bool queued; // Whether it's waiting for the writer
+	bool busy; // Whether the writer is working on it
+	bool starved; // Whether a write was turned away for lack of room
+	pthread_cond_t idle; // Signaled whenever the writer finishes with it
+	struct spool *next; // Next in the writer's queue
+};
+
+void spoolinit(uint64_t);
+struct spool *spoolopen(int);
+int spoolwrite(struct spool *, const void *, size_t);
+void spoolflush(struct spool *);
+int spooldone(struct spool *);
+void spoolclose(struct spool *);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Transfer statistics implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftp_stats.h"
+#include <string.h>
+
+// Percentiles to summarize each histogram by, in tenths of a percent:
+static const unsigned QUANTILES[] = {500, 900, 990, 999};
+
+static uint64_t peek(const uint64_t *);
+static void snapshot(struct stats *, const struct stats *);
+static void merge(struct stats *, const struct stats *);
+static void dumpone(FILE *, const struct stats *);
+static void dumphist(FILE *, const char *, const struct hist *);
+static unsigned bucket(uint64_t);
+static uint64_t ceiling(unsigned);
+
+// Adds to a counter owned by the calling thread, such that other threads never see a torn value.
+// Accepts: the counter, the amount to add
+void tally(uint64_t *ctr, uint64_t amt)
+{
+	__atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED)+amt, __ATOMIC_RELAXED);
+}
+
+// Records one latency in a histogram owned by the calling thread.
+// Accepts: the histogram, the latency in microseconds
+void histadd(struct hist *h, uint64_t usecs)
+{
+	tally(h->counts+bucket(usecs), 1);
+	tally(&h->count, 1);
+	tally(&h->sum, usecs);
+	if(usecs > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h->max, usecs, __ATOMIC_RELAXED);
+}
+
+// Writes a JSON document describing each event loop's statistics, followed by their sum.
+// Accepts: the destination, the event loops' statistics, how many there are
+void dumpstats(FILE *out, const struct stats *each, unsigned count)
+{
+	struct stats copy;
+	struct stats sum;
+	memset(&sum, 0, sizeof sum);
+
+	fprintf(out, "{\"workers\":[");
+	unsigned index;
+	for(index = 0; index < count; ++index)
+	{
+		snapshot(&copy, each+index);
+		merge(&sum, &copy);
+		if(index)
+			fputc(',', out);
+		dumpone(out, &copy);
+	}
+	fprintf(out, "],\"total\":");
+	dumpone(out, &sum);
+	fprintf(out, "}\n");
+	fflush(out);
+}
+
+// Reads a counter that another thread may be updating.
+// Accepts: the counter
+// Returns: its value
+uint64_t peek(const uint64_t *ctr)
+{
+	return __atomic_load_n(ctr, __ATOMIC_RELAXED);
+}
+
+// Copies statistics that another thread may be updating, one counter at a time.
+// Accepts: the destination, the source
+void snapshot(struct stats *dst, const struct stats *src)
+{
+	const uint64_t *from = (const uint64_t *)src;
+	uint64_t *to = (uint64_t *)dst;
+	size_t index;
+	for(index = 0; index < sizeof *src/sizeof *from; ++index)
+		to[index] = peek(from+index);
+}
+
+// Accumulates one set of (privately held) statistics into another.
+// Accepts: the running sum, the statistics to add
+void merge(struct stats *dst, const struct stats *src)
+{
+	const uint64_t *from = (const uint64_t *)src;
+	uint64_t *to = (uint64_t *)dst;
+	struct hist *hists[] = {&dst->setup, &dst->rtt, &dst->total};
+	const struct hist *adds[] = {&src->setup, &src->rtt, &src->total};
+	uint64_t maxes[] = {dst->setup.max, dst->rtt.max, dst->total.max};
+
+	size_t index;
+	for(index = 0; index < sizeof *src/sizeof *from; ++index)
+		to[index] += from[index];
+
+	// Maxima don't add up:
+	for(index = 0; index < sizeof hists/sizeof *hists; ++index)
+		hists[index]->max = adds[index]->max > maxes[index] ? adds[index]->max : maxes[index];
+}
+
+// Writes one set of statistics as a JSON object.
+// Accepts: the destination, the statistics
+void dumpone(FILE *out, const struct stats *s)
+{
+	// The counters are read one at a time, so a transfer may have been seen to end without having been seen to start:
+	uint64_t ended = s->succeeded+s->failed;
+	uint64_t active = s->started > ended ? s->started-ended : 0;
+
+	fprintf(out, "{\"requests\":%llu,\"refused\":%llu,\"busy\":%llu,\"queued\":%llu,\"duplicates\":%llu,\"started\":%llu,\"active\":%llu,\"succeeded\":%llu,\"failed\":%llu,",
+			(unsigned long long)s->requests, (unsigned long long)s->refused, (unsigned long long)s->busy,
+			(unsigned long long)s->queued, (unsigned long long)s->duplicates, (unsigned long long)s->started,
+			(unsigned long long)active, (unsigned long long)s->succeeded, (unsigned long long)s->failed);
+	fprintf(out, "\"blocks\":%llu,\"retransmits\":%llu,\"timeouts\":%llu,\"bytes_out\":%llu,\"bytes_in\":%llu,\"disk_stalls\":%llu,\"rate_waits\":%llu,",
+			(unsigned long long)s->blocks, (unsigned long long)s->resent, (unsigned long long)s->timeouts,
+			(unsigned long long)s->bytesout, (unsigned long long)s->bytesin, (unsigned long long)s->stalls, (unsigned long long)s->throttled);
+	dumphist(out, "setup_us", &s->setup);
+	fputc(',', out);
+	dumphist(out, "rtt_us", &s->rtt);
+	fputc(',', out);
+	dumphist(out, "transfer_us", &s->total);
+	fputc('}', out);
+}
+
+// Writes a histogram as a named JSON object, summarized by percentiles and followed by its nonempty buckets' upper bounds and counts.
+// Accepts: the destination, the name, the histogram
+void dumphist(FILE *out, const char *name, const struct hist *h)
+{
+	fprintf(out, "\"%s\":{\"count\":%llu,\"mean\":%llu,\"max\":%llu", name,
+			(unsigned long long)h->count, (unsigned long long)(h->count ? h->sum/h->count : 0), (unsigned long long)h->max);
+
+	// Quote each percentile as its bucket's upper bound, though never more than the largest value seen:
+	uint64_t seen = 0;
+	unsigned index = 0;
+	unsigned quantile;
+	for(quantile = 0; quantile < sizeof QUANTILES/sizeof *QUANTILES; ++quantile)
+	{
+		uint64_t rank = (h->count*QUANTILES[quantile]+999)/1000;
+		while(index < HIST_BUCKETS && seen+h->counts[index] < rank)
+			seen += h->counts[index++];
+		uint64_t value = h->count && index < HIST_BUCKETS ? ceiling(index) : 0;
+		if(value > h->max)
+			value = h->max;
+		fprintf(out, ",\"p%u\":%llu", QUANTILES[quantile]%10 ? QUANTILES[quantile] : QUANTILES[quantile]/10, (unsigned long long)value);
+	}
+
+	fprintf(out, ",\"buckets\":[");
+	const char *sep = "";
+	for(index = 0; index < HIST_BUCKETS; ++index)
+		if(h->counts[index])
+		{
+			fprintf(out, "%s[%llu,%llu]", sep, (unsigned long long)ceiling(index), (unsigned long long)h->counts[index]);
+			sep = ",";
+		}
+	fprintf(out, "]}");
+}
+
+// Determines which histogram bucket holds a value.
+// Accepts: the value
+// Returns: the bucket's index
+unsigned bucket(uint64_t value)
+{
+	if(value < 16)
+		return value;
+	unsigned top = 63-__builtin_clzll(value);
+	return (top-4)*16+(value>>(top-4));
+}
+
+// Determines the largest value a histogram bucket holds.
+// Accepts: the bucket's index
+// Returns: the value
+uint64_t ceiling(unsigned index)
+{
+	if(index < 16)
+		return index;
+	unsigned shift = index/16-1;
+	uint64_t lead = index%16+16;
+	return ((lead+1)<<shift)-1;
+}
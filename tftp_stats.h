@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Transfer statistics, each set of which is only ever updated by one thread but may be read from any other without locking.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTP_STATS_H
+#define TFTP_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Buckets in a latency histogram, enough to cover every 64-bit value to within 1/16:
+#define HIST_BUCKETS 976
+
+// Distribution of latencies in microseconds, bucketed exactly below 16 and in sixteenths of each power of two above that:
+struct hist
+{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+// Everything one event loop has done since it started, which is all 64-bit counters so it can be copied and summed as such:
+struct stats
+{
+	uint64_t requests; // Requests received, including any refused
+	uint64_t refused; // Requests answered with an error
+	uint64_t busy; // Requests turned away because there was no room for them, even to wait
+	uint64_t queued; // Requests that had to wait for room before starting
+	uint64_t duplicates; // Requests ignored because the client had already asked
+	uint64_t started; // Transfers begun
+	uint64_t succeeded; // Transfers finished successfully
+	uint64_t failed; // Transfers abandoned
+	uint64_t blocks; // DATA blocks transmitted, including retransmissions
+	uint64_t resent; // Retransmitted DATA blocks
+	uint64_t timeouts; // Waits that expired without hearing from the peer
+	uint64_t bytesout; // File contents transmitted, including retransmissions
+	uint64_t bytesin; // File contents received and written
+	uint64_t stalls; // DATA blocks that had to wait for the disk because read-ahead hadn't kept up
+	uint64_t throttled; // Times a window was cut short to wait for bandwidth
+	struct hist setup; // From receiving a request to sending the first reply
+	struct hist rtt; // Round trips, as sampled for retransmission timing
+	struct hist total; // From receiving a request to finishing the transfer successfully
+};
+
+void tally(uint64_t *, uint64_t);
+void histadd(struct hist *, uint64_t);
+void dumpstats(FILE *, const struct stats *, unsigned);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// io_uring implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#define _GNU_SOURCE
+#include "tftp_uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Sets up a ring, if the kernel supports them and they haven't been disabled.
+// Accepts: the ring, how many entries it should be able to hold
+// Returns: whether it's ready for use
+bool uringinit(struct uring *r, unsigned entries)
+{
+	memset(r, 0, sizeof *r);
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+	if((r->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+		return 0;
+
+	// Older kernels map the two queues separately:
+	size_t sqlen = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+	size_t cqlen = params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single && cqlen > sqlen)
+		sqlen = cqlen;
+	uint8_t *sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	uint8_t *cq = single ? sq : mmap(NULL, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, params.sq_entries*sizeof *r->sqes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		// Give back whichever did get mapped:
+		if(r->sqes != MAP_FAILED)
+			munmap(r->sqes, params.sq_entries*sizeof *r->sqes);
+		if(!single && cq != MAP_FAILED)
+			munmap(cq, cqlen);
+		if(sq != MAP_FAILED)
+			munmap(sq, sqlen);
+		close(r->fd);
+		r->fd = -1;
+		return 0;
+	}
+
+	r->sqhead = (unsigned *)(sq+params.sq_off.head);
+	r->sqtail = (unsigned *)(sq+params.sq_off.tail);
+	r->sqmask = *(unsigned *)(sq+params.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq+params.sq_off.array);
+	r->cqhead = (unsigned *)(cq+params.cq_off.head);
+	r->cqtail = (unsigned *)(cq+params.cq_off.tail);
+	r->cqmask = *(unsigned *)(cq+params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq+params.cq_off.cqes);
+	r->tail = *r->sqtail;
+	r->entries = params.sq_entries;
+	r->sqring = sq;
+	r->sqlen = sqlen;
+	r->cqring = cq;
+	r->cqlen = cqlen;
+	return 1;
+}
+
+// Claims the next submission queue entry, which is queued but not submitted until uringsubmit().
+// Accepts: the ring
+// Returns: the cleared entry, or NULL if the queue is full
+struct io_uring_sqe *uringsqe(struct uring *r)
+{
+	if(r->tail-__atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE) == r->entries)
+		return NULL;
+
+	unsigned index = r->tail++&r->sqmask;
+	struct io_uring_sqe *sqe = r->sqes+index;
+	memset(sqe, 0, sizeof *sqe);
+	r->sqarray[index] = index;
+	return sqe;
+}
+
+// Hands all queued entries to the kernel and waits for some completions, all with a single system call where possible.
+// Accepts: the ring, how many completions to have waiting before returning
+// Returns: whether it worked, or else errno is set
+bool uringsubmit(struct uring *r, unsigned wait)
+{
+	__atomic_store_n(r->sqtail, r->tail, __ATOMIC_RELEASE);
+	while(1)
+	{
+		unsigned queued = r->tail-__atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+		unsigned ready = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)-*r->cqhead;
+		if(!queued && ready >= wait)
+			return 1;
+
+		if(syscall(__NR_io_uring_enter, r->fd, queued, ready < wait ? wait-ready : 0, ready < wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 && errno != EINTR)
+			return 0;
+	}
+}
+
+// Takes the oldest completion off the queue.
+// Accepts: the ring, where to copy the completion
+// Returns: whether there was one
+bool uringreap(struct uring *r, struct io_uring_cqe *cqe)
+{
+	unsigned head = *r->cqhead;
+	if(head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*cqe = r->cqes[head&r->cqmask];
+	__atomic_store_n(r->cqhead, head+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Counts the entries submitted that the kernel has yet to take, as when submission failed.
+// Accepts: the ring
+// Returns: how many there are, which are the most recently queued
+unsigned uringunsent(const struct uring *r)
+{
+	return r->tail-__atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+}
+
+// Tears down a ring, unmapping its queues and closing it.
+// Accepts: the ring, which must have been set up successfully
+void uringfree(struct uring *r)
+{
+	munmap(r->sqes, r->entries*sizeof *r->sqes);
+	if(r->cqring != r->sqring)
+		munmap(r->cqring, r->cqlen);
+	munmap(r->sqring, r->sqlen);
+	close(r->fd);
+	r->fd = -1;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Minimal io_uring submission and completion queues, driven directly through the system calls.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTP_URING_H
+#define TFTP_URING_H
+
+#include "tftp_protoc.h"
+#include <linux/io_uring.h>
+
+// One ring, which belongs to a single thread:
+struct uring
+{
+	int fd;
+	unsigned *sqhead; // Shared with the kernel
+	unsigned *sqtail;
+	unsigned sqmask;
+	unsigned *sqarray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned tail; // Just past the last entry filled in, which the kernel doesn't see until it's submitted
+	unsigned entries; // Most that may be outstanding at once
+	void *sqring; // Where the queues are mapped, and how big those mappings are
+	size_t sqlen;
+	void *cqring;
+	size_t cqlen;
+};
+
+bool uringinit(struct uring *, unsigned);
+struct io_uring_sqe *uringsqe(struct uring *);
+bool uringsubmit(struct uring *, unsigned);
+bool uringreap(struct uring *, struct io_uring_cqe *);
+unsigned uringunsent(const struct uring *);
+void uringfree(struct uring *);
+
+#endif
@@ -0,0 +1,1130 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// TFTP transfer state machine implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#define _GNU_SOURCE
+#include "tftp_xfer.h"
+#include "tftp_ascii.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+const int XFER_TIMEOUT_MS = 1000;
+const int XFER_RTO_MIN_MS = 50;
+const int XFER_RTO_MAX_MS = 4000;
+const unsigned XFER_RETRIES = 6;
+const int XFER_PROGRESS_MS = 250;
+const unsigned XFER_PREFETCH = 4;
+
+// Where this thread should resume if copying from a mapped file faults because the file was truncated, or NULL if it isn't doing so:
+static __thread sigjmp_buf *mapfault;
+static pthread_once_t trapping = PTHREAD_ONCE_INIT;
+
+static uint16_t blkno(const struct xfer *, size_t);
+static bool unsent(const struct xfer *);
+static void fillwindow(struct xfer *);
+static void prefetch(struct xfer *, off_t);
+static ssize_t readblock(struct xfer *, void *, off_t);
+static ssize_t encblock(struct xfer *, void *, off_t);
+static bool copymapped(void *, const uint8_t *, size_t);
+static void trapfaults(void);
+static void onfault(int);
+static void acceptdata(struct xfer *, const uint8_t *, size_t);
+static void joingroup(struct xfer *);
+static void acceptblock(struct xfer *, const uint8_t *, size_t);
+static void ackgap(struct xfer *);
+static void resendreq(struct xfer *);
+static void unoptioned(struct xfer *);
+static void startprobe(struct xfer *, size_t);
+static void measure(struct xfer *);
+static void setrto(struct xfer *);
+static void rearm(struct xfer *);
+static void fail(struct xfer *, const char *);
+static void report(struct xfer *);
+static void xferwait(struct xfer *);
+
+// Prepares a transfer without sending anything.
+// Accepts: the transfer, its socket, the file to read or write, options, peer's transfer ID or NULL if not yet known
+void xferinit(struct xfer *x, int sfd, int fd, const struct xferopts *opts, const struct sockaddr_in *peer)
+{
+	memset(x, 0, sizeof *x);
+	x->sfd = sfd;
+	x->fd = fd;
+	x->groupfd = -1;
+	x->opts = *opts;
+	if(peer)
+	{
+		x->peer = *peer;
+		x->peerknown = 1;
+	}
+	x->base = 1;
+	x->next = 1;
+	x->srtt = -1;
+	x->prefetch = XFER_PREFETCH;
+	x->began = xfermicros();
+	setrto(x);
+	rearm(x);
+}
+
+// Starts the server's side of a transfer in answer to a request from the (already known) peer.
+// Accepts: the transfer, OPC_RRQ or OPC_WRQ
+void xferserve(struct xfer *x, uint16_t oper)
+{
+	// A reader must confirm our options before the data starts:
+	if(oper == OPC_RRQ && x->opts.present)
+	{
+		x->oacked = 1;
+		x->state = XFER_CONFIRM;
+		sendoack(x->sfd, &x->opts, &x->peer);
+		startprobe(x, 0);
+		rearm(x);
+	}
+	else if(oper == OPC_RRQ)
+		xfersend(x);
+	else // oper == OPC_WRQ
+	{
+		xferrecv(x, 0);
+		if(x->opts.present)
+		{
+			x->oacked = 1;
+			sendoack(x->sfd, &x->opts, &x->peer);
+		}
+		else
+			sendack(x->sfd, 0, &x->peer);
+		startprobe(x, 1);
+	}
+}
+
+// Starts the client's side of a transfer by sending a request, which is repeated until the server answers it.
+// Accepts: the transfer, OPC_RRQ or OPC_WRQ, the request packet (which must outlive the transfer), its length, the server's address
+void xferask(struct xfer *x, uint16_t oper, const void *req, size_t len, const struct sockaddr_in *server)
+{
+	x->peer = *server;
+	x->peerknown = 0;
+	x->req = req;
+	x->reqlen = len;
+	resendreq(x);
+
+	// Time the request, which a reader's server may answer with the first block itself:
+	startprobe(x, 1);
+	if(oper == OPC_RRQ)
+		xferrecv(x, x->opts.present != 0);
+	else // oper == OPC_WRQ
+	{
+		x->state = XFER_REQUEST;
+		rearm(x);
+	}
+}
+
+// Hands a multicast transfer to a new master, which will say where to resume.  Any other client may already have heard some of the file.
+// Accepts: the transfer, the new master's transfer ID
+void xferpass(struct xfer *x, const struct sockaddr_in *master)
+{
+	x->peer = *master;
+	x->heard = 0;
+	x->error = NULL;
+	x->retries = 0;
+	x->probeat = 0;
+	x->opts.master = 1;
+	x->state = XFER_CONFIRM;
+	sendoack(x->sfd, &x->opts, &x->peer);
+	startprobe(x, 0);
+	rearm(x);
+}
+
+// Begins transmitting the file to the (already known) peer.
+// Accepts: the transfer
+void xfersend(struct xfer *x)
+{
+	x->state = XFER_SEND;
+	fitwindow(x->sfd, &x->opts);
+	fillwindow(x);
+	rearm(x);
+}
+
+// Begins waiting for the file to arrive.  When we're still awaiting a response to requested options, an opening OACK is validated and acknowledged, whereas opening with DATA means the sender ignored them.
+// Accepts: the transfer, whether its options still await a response
+void xferrecv(struct xfer *x, bool oackable)
+{
+	x->state = XFER_RECV;
+	x->oackable = oackable;
+	if(!oackable)
+		fitwindow(x->sfd, &x->opts);
+	rearm(x);
+}
+
+// Reacts to a datagram that arrived on the transfer's socket.
+// Accepts: the transfer, the packet, its length, its source address
+void xferinput(struct xfer *x, const void *pkt, size_t len, const struct sockaddr_in *from)
+{
+	if(xferfinished(x) || len < 4)
+		return;
+
+	// Only our peer may take part, though a reader learns its transfer ID from the first reply:
+	if(!x->peerknown)
+	{
+		x->peer = *from;
+		x->peerknown = 1;
+	}
+	else if(from->sin_addr.s_addr != x->peer.sin_addr.s_addr || from->sin_port != x->peer.sin_port)
+	{
+		senderr(x->sfd, ERR_UNKNOWNTID, (struct sockaddr_in *)from);
+		return;
+	}
+	x->heard = 1;
+	x->retries = 0;
+
+	uint16_t opc = getopc(pkt);
+	if(opc == OPC_ERR)
+	{
+		fail(x, strerr((void *)pkt, len));
+		return;
+	}
+
+	if(x->state == XFER_REQUEST)
+	{
+		// The server may grant some of our options, or ignore them all:
+		if(opc == OPC_OAK)
+		{
+			if(!acceptoack(pkt, len, &x->opts))
+			{
+				senderr(x->sfd, ERR_BADOPTS, &x->peer);
+				fail(x, "Unacceptable option acknowledgment");
+				return;
+			}
+		}
+		else if(opc == OPC_ACK && getblk(pkt) == 0)
+			unoptioned(x);
+		else
+			return;
+		measure(x);
+		setrto(x);
+		xfersend(x);
+	}
+	else if(x->state == XFER_CONFIRM)
+	{
+		// A multicast master may already have the start of the file, or even all of it:
+		bool grouped = (x->opts.present & OPTF_MULTICAST) != 0;
+		if(opc == OPC_ACK && (getblk(pkt) == 0 || grouped))
+		{
+			measure(x);
+			x->base = getblk(pkt)+1;
+			x->next = x->base;
+			if(x->last && x->base > x->last)
+			{
+				x->state = XFER_DONE;
+				x->ended = xfermicros();
+			}
+			else
+				xfersend(x);
+		}
+	}
+	else if(x->state == XFER_SEND)
+	{
+		if(opc != OPC_ACK)
+			return;
+
+		// Slide the window past whatever the receiver has, and resend anything after that.  A multicast master may have heard blocks from earlier rounds, so it can leap ahead of what we've sent:
+		size_t cycle = 0x10000-x->opts.rollover;
+		size_t ahead = (getblk(pkt)+cycle-x->base%cycle)%cycle;
+		if(ahead < x->next-x->base || (x->opts.present & OPTF_MULTICAST && getblk(pkt) >= x->base))
+		{
+			x->base += ahead+1;
+			x->next = x->base;
+			if(x->probeat && x->base > x->probe)
+				measure(x);
+			if(x->last && x->base > x->last)
+			{
+				x->state = XFER_DONE;
+				x->ended = xfermicros();
+				return;
+			}
+			fillwindow(x);
+			rearm(x);
+		}
+		else if(ahead == cycle-1 && x->next > x->base)
+		{
+			// The receiver gave up waiting for the window, so there's no sense in waiting out our own timer:
+			x->next = x->base;
+			fillwindow(x);
+			rearm(x);
+		}
+	}
+	else if(x->state == XFER_RECV)
+	{
+		if(x->oackable && opc == OPC_OAK)
+		{
+			if(!acceptoack(pkt, len, &x->opts))
+			{
+				senderr(x->sfd, ERR_BADOPTS, &x->peer);
+				fail(x, "Unacceptable option acknowledgment");
+				return;
+			}
+			x->oackable = 0;
+
+			// Now that we know how big the file is, make room for all of it at once:
+			if(x->opts.present & OPTF_TSIZE && !preallocate(x->fd, x->opts.tsize))
+			{
+				diagerrno(x->sfd, &x->peer);
+				fail(x, "Not enough disk space");
+				return;
+			}
+			measure(x);
+			setrto(x);
+			fitwindow(x->sfd, &x->opts);
+			if(x->opts.present & OPTF_MULTICAST)
+				joingroup(x);
+			else
+			{
+				sendack(x->sfd, 0, &x->peer);
+				startprobe(x, 1);
+			}
+			rearm(x);
+		}
+		else if(x->opts.present & OPTF_MULTICAST && opc == OPC_OAK)
+		{
+			// We've been made master (or our answer was lost), so say which block we're missing first:
+			struct xferopts update = x->opts;
+			if(parseopts(pkt+2, len-2, &update) && update.master)
+			{
+				// Our patience wore thin while we were only listening:
+				if(!x->opts.master)
+					setrto(x);
+				x->opts.master = 1;
+				ackgap(x);
+			}
+		}
+		else if(opc == OPC_DAT)
+		{
+			// Hearing DATA first means our options were ignored:
+			if(x->oackable)
+			{
+				unoptioned(x);
+				x->oackable = 0;
+				setrto(x);
+			}
+			if(x->opts.present & OPTF_MULTICAST)
+				acceptblock(x, pkt, len);
+			else
+				acceptdata(x, pkt, len);
+		}
+	}
+	else if(x->state == XFER_DALLY)
+	{
+		// The sender is still resending its final window, so tell it again that we have all of it:
+		if(opc == OPC_DAT)
+			sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+	}
+}
+
+// Reacts to the current wait having timed out, by retransmitting with a longer timeout or finally giving up.
+// Accepts: the transfer
+void xferexpire(struct xfer *x)
+{
+	if(xferfinished(x))
+		return;
+	if(x->state == XFER_DALLY)
+	{
+		x->state = XFER_DONE;
+		return;
+	}
+	if(x->state == XFER_FLUSH || x->held || (x->state == XFER_SEND && x->next == x->base))
+	{
+		// The disk or the scheduler is slow, not the network, so there's nothing to retransmit:
+		rearm(x);
+		return;
+	}
+	if(x->stats)
+		tally(&x->stats->timeouts, 1);
+	if(++x->retries > XFER_RETRIES)
+	{
+		fail(x, "Transfer timed out");
+		return;
+	}
+
+	// Back off, and don't take a sample that might have timed a retransmission:
+	x->probeat = 0;
+	if(!x->opts.timeout && (x->rto *= 2) > XFER_RTO_MAX_MS)
+		x->rto = XFER_RTO_MAX_MS;
+
+	if(x->state == XFER_REQUEST || (x->state == XFER_RECV && !x->peerknown))
+		resendreq(x);
+	else if(x->state == XFER_CONFIRM)
+		sendoack(x->sfd, &x->opts, &x->peer);
+	else if(x->state == XFER_SEND)
+	{
+		// The end of the window must have been lost, so resend all of it:
+		x->next = x->base;
+		fillwindow(x);
+	}
+	else if(x->state == XFER_RECV && x->opts.present & OPTF_MULTICAST)
+	{
+		// Only the master speaks up, though everyone keeps listening:
+		if(x->opts.master)
+			ackgap(x);
+	}
+	else if(x->state == XFER_RECV && x->peerknown)
+	{
+		// Our last acknowledgment may have been lost:
+		if(x->next == 1 && x->oacked)
+			sendoack(x->sfd, &x->opts, &x->peer);
+		else
+			sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+	}
+	rearm(x);
+}
+
+// Reacts to the background writer having made room for a block it turned away, by asking the sender to resume from there, or having finished with the file, by acknowledging its end if it was written successfully.
+// Accepts: the transfer
+void xferflushed(struct xfer *x)
+{
+	if(x->state != XFER_FLUSH && !(x->state == XFER_RECV && x->held))
+		return;
+	int done = spooldone(x->spool);
+	if(done < 0)
+	{
+		diagerrno(x->sfd, &x->peer);
+		fail(x, "Unable to write the file");
+		return;
+	}
+	if(!done)
+		return;
+	if(x->state == XFER_RECV)
+	{
+		// The sender may already have had better luck resending it:
+		bool again = x->held == x->next;
+		x->held = 0;
+		if(!again)
+			return;
+		sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+		startprobe(x, x->next);
+		x->unacked = 0;
+		x->gapacked = 1;
+		rearm(x);
+		return;
+	}
+
+	sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+	x->unacked = 0;
+	x->state = XFER_DALLY;
+	x->ended = xfermicros();
+	x->deadline = xferclock()+3*x->rto;
+}
+
+// Determines whether a metered sender has room in its window that it can't fill until it's granted more bandwidth.
+// Accepts: the transfer
+// Returns: the answer
+bool xferstarved(const struct xfer *x)
+{
+	return x->metered && x->state == XFER_SEND && unsent(x);
+}
+
+// Transmits as much more of the window as a metered sender's allowance now covers.  Since the receiver can't answer until the newest block arrives, the timer starts over whenever one is sent.
+// Accepts: the transfer
+void xferresume(struct xfer *x)
+{
+	if(x->state != XFER_SEND)
+		return;
+	size_t was = x->next;
+	fillwindow(x);
+	if(x->next > was)
+		rearm(x);
+}
+
+// Determines whether a transfer has run its course, successfully or otherwise.
+// Accepts: the transfer
+// Returns: the answer
+bool xferfinished(const struct xfer *x)
+{
+	return x->state == XFER_DONE || x->state == XFER_FAILED;
+}
+
+// Reads the monotonic clock.
+// Returns: the time in milliseconds
+long long xferclock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000LL+now.tv_nsec/1000000;
+}
+
+// Reads the monotonic clock more precisely.
+// Returns: the time in microseconds
+long long xfermicros(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000LL+now.tv_nsec/1000;
+}
+
+// Describes how far along a transfer is and how fast it's going, along with how much longer it should take if the file's size is known.
+// Accepts: the transfer, a buffer, its size
+// Returns: the description's length, as from snprintf()
+int xferstatus(const struct xfer *x, char *buf, size_t len)
+{
+	uint64_t done = x->moved;
+	uint64_t total = x->opts.present & OPTF_TSIZE ? x->opts.tsize : 0;
+
+	// A sender knows the file, and counts what's been acknowledged:
+	if(x->sent)
+	{
+		struct stat st;
+		if(x->map)
+			total = x->maplen;
+		else if(!total && !fstat(x->fd, &st))
+			total = st.st_size;
+		done = (uint64_t)(x->base-1)*x->opts.blksize;
+		if(done > total)
+			done = total;
+	}
+
+	double secs = ((x->ended ? x->ended : xfermicros())-x->began)/1e6;
+	double rate = secs > 0 ? done/secs : 0;
+	if(!total || done > total)
+		return snprintf(buf, len, "%llu bytes at %.1f KiB/s", (unsigned long long)done, rate/1024);
+	return snprintf(buf, len, "%llu of %llu bytes (%u%%) at %.1f KiB/s, %.0f s left", (unsigned long long)done, (unsigned long long)total,
+			(unsigned)(100*done/total), rate/1024, rate > 0 ? (total-done)/rate : 0);
+}
+
+// Reserves disk space for a file that's about to be written, so that it can be laid out contiguously, without changing its apparent size.
+// Accepts: the file, how many bytes it will hold
+// Returns: whether there's room for it; if not, errno is set
+bool preallocate(int fd, uint64_t size)
+{
+	struct statvfs fs;
+	if(!size)
+		return 1;
+	if(!fstatvfs(fd, &fs) && (uint64_t)fs.f_bavail*fs.f_frsize < size)
+	{
+		errno = ENOSPC;
+		return 0;
+	}
+
+	// Files and filesystems that can't reserve space will just fill in as they go:
+	return !fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) || (errno != ENOSPC && errno != EFBIG);
+}
+
+// Translates a position in the file into the number its block goes by on the wire, which wraps around after 65535 to the negotiated rollover value.  Either way, the wire number is congruent to the position modulo the length of the cycle.
+// Accepts: the transfer, the block's position, counting from 1 (or 0 for the request itself)
+// Returns: its block number
+uint16_t blkno(const struct xfer *x, size_t blk)
+{
+	if(x->opts.rollover && blk)
+		return (blk-1)%0xffff+1;
+	return blk;
+}
+
+// Determines whether a sender's window has room for more of the file.
+// Accepts: the transfer
+// Returns: the answer
+bool unsent(const struct xfer *x)
+{
+	return x->next < x->base+x->opts.windowsize && (!x->last || x->next <= x->last);
+}
+
+// Transmits blocks until the window is full, the file runs out, or a metered sender's allowance does, all in as few system calls as possible.
+// Accepts: the transfer
+void fillwindow(struct xfer *x)
+{
+	size_t blksize = x->opts.blksize;
+	pktcork();
+	while(unsent(x))
+	{
+		if(x->metered && x->allowance < 4+blksize)
+		{
+			if(x->stats)
+				tally(&x->stats->throttled, 1);
+			break;
+		}
+
+		// With nowhere to put the block, leave it to be sent once it times out:
+		uint8_t *pkt = pktslot(x->sfd, x->opts.present & OPTF_MULTICAST ? &x->opts.group : &x->peer);
+		if(!pkt)
+			break;
+
+		bool again = x->next <= x->sent;
+		if(!again)
+		{
+			// Time waiting on the scheduler would be mistaken for a slow network, so a metered sender times the newest block instead:
+			if(x->metered)
+				x->probeat = 0;
+			startprobe(x, x->next);
+			x->sent = x->next;
+		}
+
+		off_t off = (off_t)(x->next-1)*blksize;
+		ssize_t len;
+		if(x->opts.netascii)
+		{
+			if((len = encblock(x, pkt+4, off)) < 0)
+			{
+				bool truncated = errno == EFAULT;
+				diagerrno(x->sfd, &x->peer);
+				fail(x, truncated ? "File was truncated while being sent" : "Unable to read the file");
+				break;
+			}
+		}
+		else if(x->map)
+		{
+			len = off < x->maplen ? x->maplen-off : 0;
+			if(len > blksize)
+				len = blksize;
+			if(!copymapped(pkt+4, x->map+off, len))
+			{
+				errno = EIO;
+				diagerrno(x->sfd, &x->peer);
+				fail(x, "File was truncated while being sent");
+				break;
+			}
+		}
+		else
+		{
+			prefetch(x, off);
+			if((len = readblock(x, pkt+4, off)) < 0)
+			{
+				diagerrno(x->sfd, &x->peer);
+				fail(x, "Unable to read the file");
+				break;
+			}
+		}
+		if(len < blksize)
+			x->last = x->next;
+
+		*(uint16_t *)pkt = htons(OPC_DAT);
+		*(uint16_t *)(pkt+2) = htons(blkno(x, x->next));
+		pktcommit(4+len);
+		++x->next;
+		if(x->metered)
+			x->allowance -= 4+len;
+
+		if(x->stats)
+		{
+			tally(&x->stats->blocks, 1);
+			tally(&x->stats->resent, again);
+			tally(&x->stats->bytesout, len);
+		}
+	}
+	pktuncork();
+}
+
+// Asks the kernel to start reading the next several windows of the file in the background, so that the disk and network work in parallel.  This only bothers once half of what it last asked for has been sent, so the requests stay large.
+// Accepts: the transfer, the offset about to be sent
+void prefetch(struct xfer *x, off_t off)
+{
+	if(!x->prefetch)
+		return;
+	if(!x->ahead)
+		posix_fadvise(x->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	off_t span = (off_t)x->prefetch*x->opts.windowsize*x->opts.blksize;
+	if(x->ahead-off > span/2)
+		return;
+	off_t from = x->ahead > off ? x->ahead : off;
+	posix_fadvise(x->fd, from, off+span-from, POSIX_FADV_WILLNEED);
+	x->ahead = off+span;
+}
+
+// Reads one block of the file, noting whether it had to wait because read-ahead hadn't brought it into memory yet.
+// Accepts: the transfer, where to put the block, its offset
+// Returns: its length, which is short only at the end of the file, or -1 with errno set if it couldn't be read
+ssize_t readblock(struct xfer *x, void *buf, off_t off)
+{
+	size_t blksize = x->opts.blksize;
+	struct iovec iov = {buf, blksize};
+	ssize_t len = preadv2(x->fd, &iov, 1, off, RWF_NOWAIT);
+
+	// Without support for that, there's no telling, so just wait:
+	bool unsure = len < 0 && errno != EAGAIN;
+	if(len < 0)
+		len = 0;
+
+	// Anything missing might just be past the end, but if not, we stalled getting it:
+	if(len < blksize)
+	{
+		ssize_t rest;
+		while((rest = pread(x->fd, (uint8_t *)buf+len, blksize-len, off+len)) < 0 && errno == EINTR);
+		if(rest < 0)
+			return -1;
+		if(rest > 0)
+		{
+			len += rest;
+			if(x->stats && !unsure)
+				tally(&x->stats->stalls, 1);
+		}
+	}
+	return len;
+}
+
+// Produces one block of a netascii sender's translation, translating only as much more of the file as it takes.  Everything before the oldest unacknowledged block is discarded first, since it will never have to be sent again.
+// Accepts: the transfer, where to put the block, its offset in the translation
+// Returns: its length, which is short only at the end of the translation, or -1 with errno set (to EFAULT if the file was truncated while mapped) if the file couldn't be read or there wasn't memory to translate it
+ssize_t encblock(struct xfer *x, void *buf, off_t off)
+{
+	size_t blksize = x->opts.blksize;
+	size_t mem = xfertextmem(&x->opts);
+	if(!x->text && !(x->text = malloc(mem)))
+		return -1;
+	uint8_t *plain = x->text+mem-blksize;
+
+	off_t stale = (off_t)(x->base-1)*blksize-x->textoff;
+	if(stale > 0)
+	{
+		x->textlen -= stale;
+		memmove(x->text, x->text+stale, x->textlen);
+		x->textoff += stale;
+	}
+
+	// The block may not have been translated yet, since the window has room for it:
+	while(x->plain >= 0 && x->textoff+(off_t)x->textlen < off+(off_t)blksize)
+	{
+		ssize_t len;
+		if(x->map)
+		{
+			len = x->plain < (off_t)x->maplen ? x->maplen-x->plain : 0;
+			if(len > blksize)
+				len = blksize;
+			if(!copymapped(plain, x->map+x->plain, len))
+			{
+				errno = EFAULT;
+				return -1;
+			}
+		}
+		else
+		{
+			prefetch(x, x->plain);
+			if((len = readblock(x, plain, x->plain)) < 0)
+				return -1;
+		}
+		x->textlen += asciienc(plain, len, x->text+x->textlen);
+		x->plain = len < blksize ? -1 : x->plain+len;
+	}
+
+	off_t len = x->textoff+x->textlen-off;
+	if(len > blksize)
+		len = blksize;
+	else if(len < 0)
+		len = 0;
+	memcpy(buf, x->text+(off-x->textoff), len);
+	return len;
+}
+
+// Determines how much memory a netascii sender needs for its translation: a window's worth, plus however much translating one more block of the file could add, plus the block itself.
+// Accepts: the negotiated options
+// Returns: the number of bytes
+size_t xfertextmem(const struct xferopts *opts)
+{
+	return (size_t)(opts->windowsize+3)*opts->blksize;
+}
+
+// Copies part of a file that's mapped into memory.  If the file has been truncated in place since it was mapped, the pages past its new end raise SIGBUS, which is caught rather than allowed to kill the whole process.
+// Accepts: where to copy to, where to copy from, how many bytes
+// Returns: whether all of them could be read
+bool copymapped(void *dst, const uint8_t *src, size_t len)
+{
+	pthread_once(&trapping, &trapfaults);
+	sigjmp_buf env;
+	if(sigsetjmp(env, 0))
+	{
+		mapfault = NULL;
+		return 0;
+	}
+	mapfault = &env;
+	memcpy(dst, src, len);
+	mapfault = NULL;
+	return 1;
+}
+
+// Installs the handler that lets copymapped() recover from faults.  It isn't masked while it runs, since it never returns to the faulting copy.
+void trapfaults(void)
+{
+	struct sigaction act;
+	memset(&act, 0, sizeof act);
+	act.sa_handler = &onfault;
+	act.sa_flags = SA_NODEFER;
+	sigemptyset(&act.sa_mask);
+	if(sigaction(SIGBUS, &act, NULL))
+		handle_error("sigaction()");
+}
+
+// Abandons a copy from a mapped file that faulted, or dies as usual if the fault happened anywhere else.
+// Accepts: the signal number
+void onfault(int sig)
+{
+	if(mapfault)
+		siglongjmp(*mapfault, 1);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// Writes a DATA block if it's the one we expected, acknowledging once per window, at the end of the file, or as soon as a block goes missing.
+// Accepts: the transfer, the packet, its length
+void acceptdata(struct xfer *x, const uint8_t *pkt, size_t len)
+{
+	if(getblk(pkt) != blkno(x, x->next))
+	{
+		// Tell the sender where to restart, unless it will have to wait for the writer anyway:
+		if(!x->gapacked && !x->held)
+		{
+			sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+			startprobe(x, x->next);
+			x->unacked = 0;
+			x->gapacked = 1;
+		}
+		return;
+	}
+	if(x->probeat && x->next == x->probe)
+		measure(x);
+
+	// Restore the local line endings of a netascii file, which may be split between blocks:
+	bool more = len == 4+x->opts.blksize;
+	const uint8_t *data = pkt+4;
+	size_t datalen = len-4;
+	uint8_t text[x->opts.netascii ? datalen+1 : 1];
+	bool cr = x->cr;
+	if(x->opts.netascii)
+	{
+		datalen = asciidec(data, datalen, text, &x->cr);
+		if(!more && x->cr)
+			text[datalen++] = '\r';
+		data = text;
+	}
+
+	int stored = 1;
+	if(datalen)
+		stored = x->spool ? spoolwrite(x->spool, data, datalen) : write(x->fd, data, datalen) == (ssize_t)datalen ? 1 : -1;
+	if(stored < 0)
+	{
+		diagerrno(x->sfd, &x->peer);
+		fail(x, "Unable to write the file");
+		return;
+	}
+	if(!stored)
+	{
+		// Let the sender's window fill up until the writer has room, then ask for this block again:
+		x->cr = cr;
+		x->held = x->next;
+		return;
+	}
+	if(x->stats)
+		tally(&x->stats->bytesin, len-4);
+	x->moved += len-4;
+	++x->next;
+	x->gapacked = 0;
+	rearm(x);
+
+	// Don't promise the sender we have the end of the file until it's safely on disk:
+	if(!more && x->spool)
+	{
+		x->state = XFER_FLUSH;
+		spoolflush(x->spool);
+		return;
+	}
+
+	// Confirm the whole window at once, or the end of the file:
+	if(++x->unacked == x->opts.windowsize || !more)
+	{
+		sendack(x->sfd, blkno(x, x->next-1), &x->peer);
+		startprobe(x, x->next);
+		x->unacked = 0;
+	}
+
+	// Stick around long enough to answer the sender if it didn't hear the end:
+	if(!more)
+	{
+		x->state = XFER_DALLY;
+		x->ended = xfermicros();
+		x->deadline = xferclock()+3*x->rto;
+	}
+}
+
+// Transmits our request to the server again.
+// Accepts: the transfer
+void resendreq(struct xfer *x)
+{
+	void *pkt = pktslot(x->sfd, &x->peer);
+	if(!pkt)
+		return;
+	memcpy(pkt, x->req, x->reqlen);
+	pktcommit(x->reqlen);
+}
+
+// Falls back to the defaults once the server has ignored our options, keeping the mode, which it must honor regardless.
+// Accepts: the transfer
+void unoptioned(struct xfer *x)
+{
+	bool netascii = x->opts.netascii;
+	initopts(&x->opts);
+	x->opts.netascii = netascii;
+}
+
+// Begins timing a round trip, unless one is already being timed.
+// Accepts: the transfer, the block whose DATA or ACK will end it
+void startprobe(struct xfer *x, size_t blk)
+{
+	if(x->probeat)
+		return;
+	x->probe = blk;
+	x->probeat = xfermicros();
+}
+
+// Completes a round-trip sample and folds it into our estimates, as in RFC 6298.
+// Accepts: the transfer
+void measure(struct xfer *x)
+{
+	if(!x->probeat)
+		return;
+	long long usecs = xfermicros()-x->probeat;
+	int rtt = usecs/1000;
+	x->probeat = 0;
+	if(x->stats)
+		histadd(&x->stats->rtt, usecs);
+
+	if(x->srtt < 0)
+	{
+		x->srtt = rtt;
+		x->rttvar = rtt/2;
+	}
+	else
+	{
+		x->rttvar = (3*x->rttvar+abs(x->srtt-rtt))/4;
+		x->srtt = (7*x->srtt+rtt)/8;
+	}
+	setrto(x);
+}
+
+// Chooses the retransmission timeout, which is fixed if the peer negotiated one and otherwise follows our round-trip estimates.
+// Accepts: the transfer
+void setrto(struct xfer *x)
+{
+	if(x->opts.timeout)
+		x->rto = x->opts.timeout*1000;
+	else if(x->srtt < 0)
+		x->rto = XFER_TIMEOUT_MS;
+	else
+	{
+		x->rto = x->srtt+4*x->rttvar;
+		if(x->rto < XFER_RTO_MIN_MS)
+			x->rto = XFER_RTO_MIN_MS;
+		else if(x->rto > XFER_RTO_MAX_MS)
+			x->rto = XFER_RTO_MAX_MS;
+	}
+}
+
+// Joins the multicast group named by the server's OACK and, if we're its master, asks for the first block.
+// Accepts: the transfer
+void joingroup(struct xfer *x)
+{
+	if((x->groupfd = openmcast(&x->opts.group, localaddr(&x->peer))) < 0)
+	{
+		senderr(x->sfd, ERR_UNKNOWN, &x->peer);
+		fail(x, "Unable to join the multicast group");
+		return;
+	}
+	fitwindow(x->groupfd, &x->opts);
+
+	// Block numbers can't wrap around, so this covers every one of them:
+	x->have = calloc((1<<16)/8+1, 1);
+	if(x->opts.master)
+		ackgap(x);
+}
+
+// Writes a multicast DATA block wherever it belongs in the file, since we may have joined partway through.  The master acknowledges once per window and as soon as a block goes missing; everyone announces when they have the whole file.
+// Accepts: the transfer, the packet, its length
+void acceptblock(struct xfer *x, const uint8_t *pkt, size_t len)
+{
+	size_t blksize = x->opts.blksize;
+	uint16_t blk = getblk(pkt);
+	if(!blk)
+		return;
+
+	if(!(x->have[blk/8] & 1<<blk%8))
+	{
+		if(len > 4 && pwrite(x->fd, pkt+4, len-4, (off_t)(blk-1)*blksize) != len-4)
+		{
+			diagerrno(x->sfd, &x->peer);
+			fail(x, "Unable to write the file");
+			return;
+		}
+		x->have[blk/8] |= 1<<blk%8;
+		if(x->stats)
+			tally(&x->stats->bytesin, len-4);
+		x->moved += len-4;
+		if(len < 4+blksize)
+			x->last = blk;
+		if(x->probeat && blk == x->probe)
+			measure(x);
+		size_t gap = x->next;
+		while(x->have[x->next/8] & 1<<x->next%8)
+			++x->next;
+		if(x->next != gap)
+			x->gapacked = 0;
+		rearm(x);
+
+		// There's no dallying, since the group's DATA may be for someone else by now.  If the server misses this, it just moves on to the next master when we don't answer:
+		if(x->last && x->next > x->last)
+		{
+			sendack(x->sfd, x->last, &x->peer);
+			x->state = XFER_DONE;
+			x->ended = xfermicros();
+			return;
+		}
+		// Count how far the sender's window can slide, which may be more than one block if this filled a gap:
+		if(x->opts.master && (x->unacked += x->next-gap) >= x->opts.windowsize)
+		{
+			sendack(x->sfd, x->next-1, &x->peer);
+			startprobe(x, x->next);
+			x->unacked = 0;
+		}
+	}
+
+	// Tell the sender where to restart:
+	if(x->opts.master && blk > x->next && !x->gapacked)
+	{
+		ackgap(x);
+		x->gapacked = 1;
+	}
+}
+
+// Acknowledges everything up to the first block we're missing.
+// Accepts: the transfer
+void ackgap(struct xfer *x)
+{
+	sendack(x->sfd, x->next-1, &x->peer);
+	startprobe(x, x->next);
+	x->unacked = 0;
+}
+
+// Restarts the timer for the current wait.
+// Accepts: the transfer
+void rearm(struct xfer *x)
+{
+	x->deadline = xferclock()+x->rto;
+}
+
+// Abandons a transfer.
+// Accepts: the transfer, a human-readable reason
+void fail(struct xfer *x, const char *why)
+{
+	x->state = XFER_FAILED;
+	x->error = why;
+}
+
+// Overwrites the progress line with the transfer's current status.
+// Accepts: the transfer
+void report(struct xfer *x)
+{
+	char line[128];
+	xferstatus(x, line, sizeof line);
+	fprintf(x->progress, "\r%-*s", (int)sizeof line/2, line);
+	fflush(x->progress);
+	x->reported = xferclock();
+}
+
+// Drives a transfer to completion, blocking on its socket and reporting progress if asked.
+// Accepts: the transfer
+void xferwait(struct xfer *x)
+{
+	// A multicast receiver listens on a second socket once it joins the group, and a spooled one waits on the writer at the end:
+	struct pollfd pfds[3] = {{x->sfd, POLLIN}, {-1, POLLIN}, {x->spool ? x->spool->efd : -1, POLLIN}};
+	void *pkt = pktget();
+	if(!pkt)
+	{
+		fail(x, "Out of packet buffers");
+		return;
+	}
+	while(!xferfinished(x))
+	{
+		long long now = xferclock();
+		if(x->progress && now-x->reported >= XFER_PROGRESS_MS)
+			report(x);
+
+		pfds[1].fd = x->groupfd;
+		long long left = x->deadline-now;
+		if(x->progress && left > x->reported+XFER_PROGRESS_MS-now)
+			left = x->reported+XFER_PROGRESS_MS-now;
+		if(left > 0 && poll(pfds, 3, left) > 0)
+		{
+			if(pfds[2].revents)
+				xferflushed(x);
+
+			unsigned each;
+			for(each = 0; each < 2 && !xferfinished(x); ++each)
+				if(pfds[each].revents)
+				{
+					struct sockaddr_in from;
+					size_t len = recvpkta(pfds[each].fd, pkt, &from);
+					xferinput(x, pkt, len, &from);
+				}
+		}
+		else if(xferclock() >= x->deadline)
+			xferexpire(x);
+	}
+	pktput(pkt);
+
+	if(x->progress)
+	{
+		report(x);
+		fputc('\n', x->progress);
+	}
+}
+
+// Sends a file over a network socket once the server accepts our write request, keeping up to a window's worth of blocks in flight.
+// Accepts: socket file descriptor, file descriptor, requested options (updated to the negotiated ones), the write request, its length, the server's address, where to report progress or NULL
+// Returns: NULL or a human-readable error message
+const char *sendfile(int sfd, int fd, struct xferopts *opts, const void *req, size_t reqlen, const struct sockaddr_in *server, FILE *progress)
+{
+	struct xfer x;
+	xferinit(&x, sfd, fd, opts, NULL);
+	x.progress = progress;
+	xferask(&x, OPC_WRQ, req, reqlen, server);
+	xferwait(&x);
+	free(x.text);
+	*opts = x.opts;
+	return x.error;
+}
+
+// Receives a file over a network socket in answer to our read request, from whichever transfer ID answers first.
+// Accepts: socket file descriptor, file descriptor, requested options (updated to the negotiated ones), the read request, its length, the server's address, where to report progress or NULL
+// Returns: NULL or a human-readable error message
+const char *recvfile(int sfd, int fd, struct xferopts *opts, const void *req, size_t reqlen, const struct sockaddr_in *server, FILE *progress)
+{
+	struct xfer x;
+	xferinit(&x, sfd, fd, opts, NULL);
+	x.progress = progress;
+	if(!(opts->present & OPTF_MULTICAST))
+		x.spool = spoolopen(fd);
+	xferask(&x, OPC_RRQ, req, reqlen, server);
+	xferwait(&x);
+	if(x.spool)
+		spoolclose(x.spool);
+	if(x.groupfd >= 0)
+		close(x.groupfd);
+	free(x.have);
+	*opts = x.opts;
+	return x.error;
+}
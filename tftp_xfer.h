@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// TFTP transfer state machine, which reacts to datagrams and timeouts without ever blocking on the network.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTP_XFER_H
+#define TFTP_XFER_H
+
+#include "tftp_protoc.h"
+#include "tftp_spool.h"
+#include "tftp_stats.h"
+
+// Retransmission parameters:
+extern const int XFER_TIMEOUT_MS;
+extern const int XFER_RTO_MIN_MS;
+extern const int XFER_RTO_MAX_MS;
+extern const unsigned XFER_RETRIES;
+extern const int XFER_PROGRESS_MS;
+
+// Default windows of the file to read ahead of the network:
+extern const unsigned XFER_PREFETCH;
+
+// Phases of a transfer:
+enum xferstate
+{
+	XFER_REQUEST, // Sent a write request, and awaiting the server's OACK or ACK 0
+	XFER_CONFIRM, // Sent an OACK in answer to a read request, and awaiting ACK 0
+	XFER_SEND, // Transmitting DATA blocks
+	XFER_RECV, // Receiving DATA blocks
+	XFER_FLUSH, // Received everything, but waiting for it to reach the disk before acknowledging the end
+	XFER_DALLY, // Received everything, but lingering in case our final ACK was lost
+	XFER_DONE, // Finished successfully
+	XFER_FAILED, // Abandoned; see the error field
+};
+
+// Everything there is to know about one transfer, in either direction:
+struct xfer
+{
+	int sfd; // Socket dedicated to the transfer
+	int fd; // File being sent or received
+	const uint8_t *map; // Sender: the file's contents if they're already in memory, or NULL to read them from fd
+	size_t maplen;
+	unsigned prefetch; // Sender: how many windows ahead of the network to have the kernel read the file, or 0 not to
+	off_t ahead; // Sender: how far into the file we've asked it to read so far
+	bool metered; // Sender: whether it may only transmit what a scheduler grants it
+	size_t allowance; // Sender: bytes granted to it that it hasn't spent yet
+	uint8_t *text; // Netascii sender: the translation from the oldest unacknowledged block on, followed by room for a block of the file, or NULL until it's needed
+	off_t textoff; // Netascii sender: where in the translation that buffer starts
+	size_t textlen; // Netascii sender: how much of the translation it holds
+	off_t plain; // Netascii sender: how much of the file has been translated, or -1 once all of it has
+	struct sockaddr_in peer; // Remote transfer ID
+	bool peerknown; // Whether we've learned the peer's transfer ID yet
+	bool heard; // Whether anything has arrived from the peer
+	const void *req; // Client: our request, to be resent until the server answers it
+	size_t reqlen;
+	int groupfd; // Multicast receiver: socket joined to the group, or -1
+	uint8_t *have; // Multicast receiver: bitmap of the blocks written so far
+	struct spool *spool; // Receiver: where to stage the file for the background writer, or NULL to write it directly
+	struct xferopts opts; // Negotiated options
+	bool oackable; // Receiver: whether an OACK may still settle the requested options
+	bool oacked; // Whether our OACK stands in for ACK 0
+	enum xferstate state;
+	const char *error; // Human-readable reason for failure
+	size_t base; // Sender: oldest unacknowledged block
+	size_t next; // Sender: next block to transmit; receiver: next block expected
+	size_t last; // Sender: final block, once we've read it
+	unsigned unacked; // Receiver: in-order blocks since our last ACK
+	bool gapacked; // Receiver: whether we've already reported the current gap
+	size_t held; // Receiver: block the background writer had no room for, which the sender should hear nothing about until it does, or 0
+	size_t sent; // Sender: highest block transmitted so far
+	unsigned retries; // Consecutive timeouts without hearing anything
+	int srtt; // Smoothed round-trip time, in milliseconds
+	int rttvar; // Its mean deviation
+	int rto; // Current retransmission timeout, including any backoff
+	size_t probe; // Block whose arrival or acknowledgment will complete the pending round-trip sample
+	long long probeat; // When that sample began in monotonic microseconds, or 0 if none is pending
+	long long deadline; // When the current wait times out, in monotonic milliseconds
+	long long began; // When the transfer started, in monotonic microseconds
+	long long ended; // When the whole file was delivered, in monotonic microseconds, or 0 if it hasn't been yet
+	uint64_t moved; // Receiver: file contents written so far
+	bool cr; // Netascii receiver: whether the last block ended with a CR, whose meaning depends on how the next one starts
+	struct stats *stats; // Where to tally what the transfer does, or NULL
+	FILE *progress; // Client: where to report progress every so often, or NULL
+	long long reported; // When we last did so, in monotonic milliseconds
+};
+
+void xferinit(struct xfer *, int, int, const struct xferopts *, const struct sockaddr_in *);
+void xferserve(struct xfer *, uint16_t);
+void xferask(struct xfer *, uint16_t, const void *, size_t, const struct sockaddr_in *);
+void xferpass(struct xfer *, const struct sockaddr_in *);
+void xfersend(struct xfer *);
+void xferrecv(struct xfer *, bool);
+void xferinput(struct xfer *, const void *, size_t, const struct sockaddr_in *);
+void xferexpire(struct xfer *);
+void xferflushed(struct xfer *);
+bool xferstarved(const struct xfer *);
+void xferresume(struct xfer *);
+bool xferfinished(const struct xfer *);
+long long xferclock(void);
+long long xfermicros(void);
+int xferstatus(const struct xfer *, char *, size_t);
+bool preallocate(int, uint64_t);
+size_t xfertextmem(const struct xferopts *);
+
+// Blocking conveniences atop the state machine:
+const char *sendfile(int, int, struct xferopts *, const void *, size_t, const struct sockaddr_in *, FILE *);
+const char *recvfile(int, int, struct xferopts *, const void *, size_t, const struct sockaddr_in *, FILE *);
+
+#endif
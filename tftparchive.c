@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Archive builder, which packs every regular file under a directory into one indexed archive for the server to serve from.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#define _GNU_SOURCE
+#include "tftpd_archive.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A file to be packed:
+struct member
+{
+	char *name; // Pathname relative to the directory
+	char *path; // Pathname as found
+	uint64_t size;
+};
+
+// Alignment of the first file's contents, so that they don't share pages with the index:
+#define DATA_ALIGN 4096
+
+// Where the walk through the directory puts what it finds:
+static struct member *members;
+static size_t nmembers;
+static size_t prefix;
+
+static int found(const char *, const struct stat *, int, struct FTW *);
+static int byname(const void *, const void *);
+static bool pack(FILE *, const struct member *);
+
+// Packs a directory into an archive.
+// Accepts: command-line arguments
+// Returns: exit status
+int main(int argc, char **argv)
+{
+	if(argc != 3)
+	{
+		fprintf(stderr, "USAGE: %s <archive> <directory>\n", argv[0]);
+		return 1;
+	}
+
+	// Find every regular file, following symbolic links as the server would, and name each as a client of a server running in the directory would ask for it:
+	const char *root = argv[2];
+	prefix = strlen(root);
+	while(prefix > 1 && root[prefix-1] == '/')
+		--prefix;
+	if(nftw(root, &found, 64, 0))
+	{
+		perror(root);
+		return 1;
+	}
+	qsort(members, nmembers, sizeof *members, &byname);
+
+	// Lay out the index, then the pathnames, then the contents:
+	size_t each;
+	uint64_t names = sizeof(struct archead)+nmembers*sizeof(struct arcent);
+	uint64_t data = names;
+	for(each = 0; each < nmembers; ++each)
+		data += strlen(members[each].name)+1;
+	data = (data+DATA_ALIGN-1)/DATA_ALIGN*DATA_ALIGN;
+
+	// Write it under a temporary name and move it into place, since a server may have the old one mapped, and would fault if it shrank:
+	char tmp[strlen(argv[1])+8];
+	sprintf(tmp, "%s.XXXXXX", argv[1]);
+	int fd = mkstemp(tmp);
+	mode_t mask = umask(0);
+	umask(mask);
+	FILE *out = fd >= 0 && !fchmod(fd, 0666&~mask) ? fdopen(fd, "wb") : NULL;
+	if(!out)
+	{
+		perror(tmp);
+		if(fd >= 0)
+		{
+			close(fd);
+			unlink(tmp);
+		}
+		return 1;
+	}
+	struct archead head;
+	memcpy(head.magic, ARCHIVE_MAGIC, sizeof head.magic);
+	head.count = htole64(nmembers);
+	fwrite(&head, sizeof head, 1, out);
+	uint64_t name = names;
+	uint64_t off = data;
+	for(each = 0; each < nmembers; ++each)
+	{
+		struct arcent ent;
+		ent.name = htole64(name);
+		ent.data = htole64(off);
+		ent.size = htole64(members[each].size);
+		fwrite(&ent, sizeof ent, 1, out);
+		name += strlen(members[each].name)+1;
+		off += members[each].size;
+	}
+	for(each = 0; each < nmembers; ++each)
+		fwrite(members[each].name, strlen(members[each].name)+1, 1, out);
+	for(; name < data; ++name)
+		fputc('\0', out);
+	for(each = 0; each < nmembers; ++each)
+		if(!pack(out, members+each))
+		{
+			perror(members[each].path);
+			fclose(out);
+			unlink(tmp);
+			return 1;
+		}
+	bool ok = !fflush(out) && !fsync(fd);
+	if(fclose(out) || !ok)
+	{
+		perror(tmp);
+		unlink(tmp);
+		return 1;
+	}
+	if(rename(tmp, argv[1]))
+	{
+		perror(argv[1]);
+		unlink(tmp);
+		return 1;
+	}
+
+	printf("%zu files, %llu bytes\n", nmembers, (unsigned long long)off);
+	return 0;
+}
+
+// Notes down each regular file the walk finds, skipping dangling links.
+// Accepts: its pathname, its metadata, what sort of thing it is, where it is in the walk
+// Returns: 0 to keep walking, or nonzero to stop on a failure
+int found(const char *path, const struct stat *st, int type, struct FTW *unused)
+{
+	if(type == FTW_DNR || type == FTW_NS)
+	{
+		perror(path);
+		return 1;
+	}
+	if(type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	struct member *grown = realloc(members, (nmembers+1)*sizeof *members);
+	if(!grown)
+		return 1;
+	members = grown;
+	const char *rel = path+prefix;
+	while(*rel == '/')
+		++rel;
+	members[nmembers].name = strdup(rel);
+	members[nmembers].path = strdup(path);
+	members[nmembers].size = st->st_size;
+	return !members[nmembers].name || !members[nmembers++].path;
+}
+
+// Orders files by pathname, the way the server searches the index.
+// Accepts: the two files
+// Returns: their order as per strcmp()
+int byname(const void *left, const void *right)
+{
+	return strcmp(((const struct member *)left)->name, ((const struct member *)right)->name);
+}
+
+// Copies a file's contents into the archive, making sure it hasn't changed size since the walk.
+// Accepts: the archive, the file
+// Returns: whether it went into the archive intact, with errno set if not
+bool pack(FILE *out, const struct member *mem)
+{
+	FILE *in = fopen(mem->path, "rb");
+	if(!in)
+		return 0;
+	uint8_t buf[1<<16];
+	uint64_t left = mem->size;
+	size_t len;
+	while(left && (len = fread(buf, 1, left < sizeof buf ? left : sizeof buf, in)))
+	{
+		if(fwrite(buf, 1, len, out) != len)
+		{
+			fclose(in);
+			return 0;
+		}
+		left -= len;
+	}
+	bool ok = !left && fgetc(in) == EOF && !ferror(in);
+	fclose(in);
+	if(!ok)
+		errno = EIO;
+	return ok;
+}
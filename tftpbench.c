@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Load generator, which simulates many concurrent clients against a server and reports how it fared as JSON.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#define _GNU_SOURCE
+#include "tftp_xfer.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// One simulated client's transfer:
+struct client
+{
+	struct xfer xfer;
+	void *req; // Its request, which must outlive the transfer
+	long long began; // When it was requested, in monotonic microseconds
+	bool answered; // Whether we've timed the server's first reply
+	bool completed; // Whether we've timed the file's arrival, even if we're still dallying
+	struct client *next;
+};
+
+// An event loop driving its share of the clients:
+struct driver
+{
+	pthread_t thread;
+	int epfd;
+	unsigned running; // Clients that haven't yet completed
+	struct client *clients;
+	struct pktbatch inbox;
+	struct stats stats; // What its clients have done, which only it updates
+};
+
+// Most readiness notifications to handle per wakeup:
+#define EVENTS_MAX 64
+
+// What to ask of the server:
+static struct sockaddr_in server;
+static struct xferopts reqopts;
+static size_t filesize;
+static unsigned readpct;
+static char prefix[32];
+
+// Clients each driver keeps busy at once:
+static unsigned share;
+
+// Contents of every file we upload, and where every file we download goes:
+static int source;
+static int devnull;
+
+// Transfers to run in all, and how many drivers have claimed so far:
+static unsigned transfers;
+static unsigned claimed;
+
+static void *driver(void *);
+static bool begin(struct driver *);
+static void service(struct driver *, struct client *);
+static void settle(struct driver *, struct client *);
+static void retire(struct driver *, struct client *);
+
+// Uploads the file to be downloaded, runs the drivers, and reports the results.
+// Accepts: command-line arguments
+// Returns: exit status
+int main(int argc, char **argv)
+{
+	// Parse command-line flags:
+	transfers = 1000;
+	unsigned nthreads = 1;
+	unsigned concurrency = 100;
+	filesize = 1<<20;
+	readpct = 100;
+	initopts(&reqopts);
+	int flag;
+	while((flag = getopt(argc, argv, "c:n:s:b:w:r:t:")) != -1)
+	{
+		if(flag == 'c')
+			concurrency = atoi(optarg);
+		else if(flag == 'n')
+			transfers = atoi(optarg);
+		else if(flag == 's')
+			filesize = strtoull(optarg, NULL, 0);
+		else if(flag == 'b')
+		{
+			reqopts.blksize = atoi(optarg);
+			reqopts.present |= OPTF_BLKSIZE;
+			if(reqopts.blksize < BLKSIZE_MIN || reqopts.blksize > BLKSIZE_MAX)
+			{
+				fprintf(stderr, "%s: block size must be between %zu and %zu\n", argv[0], BLKSIZE_MIN, BLKSIZE_MAX);
+				return 1;
+			}
+		}
+		else if(flag == 'w')
+		{
+			reqopts.windowsize = atoi(optarg);
+			reqopts.present |= OPTF_WINDOWSIZE;
+			if(reqopts.windowsize < 1 || reqopts.windowsize > WINDOWSIZE_MAX)
+			{
+				fprintf(stderr, "%s: window size must be between 1 and %u\n", argv[0], WINDOWSIZE_MAX);
+				return 1;
+			}
+		}
+		else if(flag == 'r')
+			readpct = atoi(optarg);
+		else if(flag == 't')
+			nthreads = atoi(optarg);
+		else
+			optind = argc+1;
+	}
+	if(optind >= argc || argc-optind > 2 || !concurrency || !transfers || !nthreads || readpct > 100 || filesize/reqopts.blksize >= 0xffff)
+	{
+		fprintf(stderr, "USAGE: %s [-c concurrency] [-n transfers] [-s file size] [-b blksize] [-w windowsize] [-r percent reads] [-t threads] <hostname> [port]\n", argv[0]);
+		fprintf(stderr, "The file must have fewer than 65535 blocks.\n");
+		return 1;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	char port[6];
+	snprintf(port, sizeof port, "%hu", PORT_UNPRIVILEGED);
+	struct addrinfo *found;
+	if(getaddrinfo(argv[optind], argc-optind > 1 ? argv[optind+1] : port, &hints, &found))
+	{
+		fprintf(stderr, "%s: unable to resolve %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+	server = *(struct sockaddr_in *)found->ai_addr;
+	freeaddrinfo(found);
+
+	// Every upload gets a fresh name, and every download shares a file we upload first:
+	snprintf(prefix, sizeof prefix, "bench.%d", getpid());
+	if((source = memfd_create(prefix, 0)) < 0 || ftruncate(source, filesize) || (devnull = open("/dev/null", O_WRONLY)) < 0)
+		handle_error("setup");
+	uint8_t *req = pktget();
+	if(!req)
+		handle_error("pktget()");
+	int sfd = openudp(0);
+	struct xferopts opts = reqopts;
+	const char *res = sendfile(sfd, source, &opts, req, fmtreq(req, PKT_MAX, prefix, OPC_WRQ, &opts), &server, NULL);
+	close(sfd);
+	pktput(req);
+	if(res)
+	{
+		fprintf(stderr, "%s: unable to upload %s: %s\n", argv[0], prefix, res);
+		return 1;
+	}
+
+	// Split the clients among the drivers, which claim transfers as they go:
+	share = (concurrency+nthreads-1)/nthreads;
+	struct driver drivers[nthreads];
+	memset(drivers, 0, sizeof drivers);
+	long long began = xfermicros();
+	unsigned index;
+	for(index = 0; index < nthreads; ++index)
+	{
+		if((drivers[index].epfd = epoll_create1(0)) < 0)
+			handle_error("epoll_create1()");
+		if(pthread_create(&drivers[index].thread, NULL, &driver, drivers+index))
+			handle_error("pthread_create()");
+	}
+	for(index = 0; index < nthreads; ++index)
+		pthread_join(drivers[index].thread, NULL);
+	long long elapsed = xfermicros()-began;
+
+	// Report the totals alongside the full breakdown:
+	struct stats each[nthreads];
+	uint64_t succeeded = 0;
+	uint64_t failed = 0;
+	for(index = 0; index < nthreads; ++index)
+	{
+		each[index] = drivers[index].stats;
+		succeeded += each[index].succeeded;
+		failed += each[index].failed;
+	}
+	printf("{\"concurrency\":%u,\"transfers\":%u,\"file_size\":%zu,\"blksize\":%zu,\"windowsize\":%u,\"read_percent\":%u,\"threads\":%u,",
+			concurrency, transfers, filesize, reqopts.blksize, reqopts.windowsize, readpct, nthreads);
+	printf("\"succeeded\":%llu,\"failed\":%llu,\"elapsed_us\":%lld,\"transfers_per_sec\":%.1f,\"throughput_bytes_per_sec\":%.0f,\"client\":",
+			(unsigned long long)succeeded, (unsigned long long)failed, elapsed, succeeded*1e6/elapsed, succeeded*filesize*1e6/elapsed);
+	dumpstats(stdout, each, nthreads);
+	printf("}\n");
+
+	return failed != 0;
+}
+
+// Runs one event loop, keeping its share of the clients busy until no transfers remain.
+// Accepts: the driver
+// Returns: NULL
+void *driver(void *arg)
+{
+	struct driver *d = arg;
+	if(!batchinit(&d->inbox, BATCH_MAX))
+		handle_error("batchinit()");
+
+	struct epoll_event events[EVENTS_MAX];
+	while(1)
+	{
+		// Replace every client that's completed, so long as there's work left:
+		while(d->running < share && begin(d));
+		if(!d->clients)
+			break;
+
+		// Sleep until something arrives or the soonest retransmission falls due:
+		long long now = xferclock();
+		int timeout = -1;
+		struct client *each;
+		for(each = d->clients; each; each = each->next)
+		{
+			long long left = each->xfer.deadline-now;
+			if(left < 0)
+				left = 0;
+			if(timeout < 0 || left < timeout)
+				timeout = left;
+		}
+		int nevents = epoll_wait(d->epfd, events, EVENTS_MAX, timeout);
+
+		pktcork();
+		int index;
+		for(index = 0; index < nevents; ++index)
+			service(d, events[index].data.ptr);
+
+		// Retransmit or give up on anyone that hasn't heard from the server in a while:
+		now = xferclock();
+		struct client *next;
+		for(each = d->clients; each; each = next)
+		{
+			next = each->next;
+			if(each->xfer.deadline <= now)
+			{
+				xferexpire(&each->xfer);
+				settle(d, each);
+			}
+		}
+		pktuncork();
+	}
+
+	batchfree(&d->inbox);
+	return NULL;
+}
+
+// Starts another transfer, unless they've all been claimed.
+// Accepts: the driver to run it
+// Returns: whether there was one to start
+bool begin(struct driver *d)
+{
+	unsigned serial = __atomic_fetch_add(&claimed, 1, __ATOMIC_RELAXED);
+	if(serial >= transfers)
+		return 0;
+
+	// Spread the reads evenly among the writes:
+	bool reading = (serial+1)*readpct/100 != serial*readpct/100;
+	uint16_t oper = reading ? OPC_RRQ : OPC_WRQ;
+	char filename[sizeof prefix+16];
+	if(reading)
+		strcpy(filename, prefix);
+	else
+		snprintf(filename, sizeof filename, "%s.%u", prefix, serial);
+
+	int sfd = openudp(0);
+	if(sfd < 0)
+		handle_error("socket()");
+	fcntl(sfd, F_SETFL, O_NONBLOCK);
+	pktgro(sfd);
+
+	struct client *c = calloc(1, sizeof *c);
+	c->req = malloc(PKT_MAX);
+	c->next = d->clients;
+	d->clients = c;
+	++d->running;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(d->epfd, EPOLL_CTL_ADD, sfd, &ev))
+		handle_error("epoll_ctl()");
+
+	tally(&d->stats.requests, 1);
+	tally(&d->stats.started, 1);
+	c->began = xfermicros();
+	xferinit(&c->xfer, sfd, reading ? devnull : source, &reqopts, NULL);
+	c->xfer.stats = &d->stats;
+	xferask(&c->xfer, oper, c->req, fmtreq(c->req, PKT_MAX, filename, oper, &reqopts), &server);
+	return 1;
+}
+
+// Feeds a client all the datagrams waiting on its socket, a batch at a time.
+// Accepts: the driver that owns it, the client
+void service(struct driver *d, struct client *c)
+{
+	unsigned count;
+	do
+	{
+		count = recvbatch(c->xfer.sfd, &d->inbox, d->inbox.cap);
+		unsigned each;
+		for(each = 0; each < count; ++each)
+			xferinput(&c->xfer, batchbuf(&d->inbox, each), batchlen(&d->inbox, each), batchaddr(&d->inbox, each));
+	}
+	while(count == d->inbox.cap && !xferfinished(&c->xfer));
+
+	settle(d, c);
+}
+
+// Times whatever milestones a client has just reached, and retires it once it's over.
+// Accepts: the driver that owns it, the client
+void settle(struct driver *d, struct client *c)
+{
+	long long now = xfermicros();
+	if(!c->answered && c->xfer.heard)
+	{
+		histadd(&d->stats.setup, now-c->began);
+		c->answered = 1;
+	}
+
+	// A reader has the whole file as soon as it starts dallying, and its slot may go to someone else:
+	if(!c->completed && (c->xfer.state == XFER_DALLY || xferfinished(&c->xfer)))
+	{
+		if(c->xfer.state == XFER_FAILED)
+			tally(&d->stats.failed, 1);
+		else
+		{
+			tally(&d->stats.succeeded, 1);
+			histadd(&d->stats.total, now-c->began);
+		}
+		c->completed = 1;
+		--d->running;
+	}
+
+	if(xferfinished(&c->xfer))
+		retire(d, c);
+}
+
+// Disposes of a finished client.
+// Accepts: the driver that owns it, the client
+void retire(struct driver *d, struct client *c)
+{
+	struct client **link;
+	for(link = &d->clients; *link != c; link = &(*link)->next);
+	*link = c->next;
+
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, c->xfer.sfd, NULL);
+	close(c->xfer.sfd);
+	free(c->req);
+	free(c);
+}
@@ -17,94 +17,728 @@
 // Simple TFTP server implementation.
 // Author: Sol Boucher <slb1566@rit.edu>
 
-#include "tftp_protoc.h"
+#define _GNU_SOURCE
+#include "tftp_xfer.h"
+#include "tftpd_cache.h"
+#include "tftpd_names.h"
+#include "tftpd_archive.h"
+#include "tftpd_rate.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-static void *connection(void *);
+// A multicast client waiting its turn as master:
+struct member
+{
+	struct sockaddr_in addr;
+	struct member *next;
+};
+
+// Bookkeeping for each transfer in progress:
+struct session
+{
+	struct xfer xfer;
+	const struct cachent *cached; // Contents being sent from the cache, if any
+	char *mcfile; // Multicast: name of the file being sent to the group, or NULL for a unicast transfer
+	struct member *members; // Multicast: other clients that may still be missing blocks, in order of arrival
+	long long began; // When its request arrived, in monotonic microseconds
+	bool shared; // Whether it borrows the worker's request socket instead of having its own
+	struct ratebucket *limit; // Bandwidth allotted to its client, or NULL if only the server's total is capped
+	unsigned fds; // File descriptors it holds
+	uint64_t mem; // Bytes of buffers it holds, besides any cached file
+	bool dead; // Whether it's over, but events already received may still name it
+	struct session *prev;
+	struct session *next;
+	struct session *hnext; // Next in the same bucket of the worker's session table
+	unsigned timer; // Where it is in the worker's heap of deadlines
+};
+
+// A client whose transfer on the request socket has ended, whose stragglers shouldn't be mistaken for strangers':
+struct grave
+{
+	struct sockaddr_in addr;
+	long long until; // When to stop recognizing it, in monotonic milliseconds
+	struct grave *hnext; // Next in the same bucket of the worker's grave table
+};
+
+// A request waiting for room to start:
+struct pending
+{
+	struct sockaddr_in addr;
+	uint8_t *req; // Copy of the datagram
+	size_t len;
+	long long arrived; // When it first arrived, in monotonic microseconds
+	long long seen; // When the client last asked, in monotonic milliseconds
+};
+
+// An event loop with its own request socket, which owns every transfer it starts:
+struct worker
+{
+	pthread_t thread;
+	int cpu; // Processor to pin to, or -1 to let it float
+	int epfd;
+	int listenfd;
+	struct session *sessions;
+	unsigned nsessions;
+	struct session *turn; // Where the scheduler should start its next round, or NULL for the beginning
+	struct session *dead; // Sessions ended since it last waited for events, linked through next, to be freed once none can refer to them
+	struct session **table; // Sessions hashed by the client's address and port
+	unsigned tablemask; // One less than the number of buckets, which is a power of two
+	struct session **timers; // Sessions ordered by when they time out, as a binary min-heap
+	bool hungry; // Whether any transfer was still waiting on bandwidth when they were last scheduled
+	struct grave *graves; // Recently finished sessions that shared the request socket, as a ring as long as the concurrency limit
+	struct grave **gravetable; // The same, hashed like the session table
+	unsigned nextgrave;
+	struct pending *pending; // Requests waiting for room, as a ring as long as the queue limit
+	unsigned pendhead; // Where the oldest one is
+	unsigned npending;
+	struct pktbatch inbox; // Space to receive datagrams into
+	long long arrived; // When the requests being handled arrived, in monotonic microseconds
+	long long reported; // When it last logged its transfers' progress, in monotonic milliseconds
+	struct stats *stats; // What it's done, which only it updates
+};
+
+// Most readiness notifications to handle per wakeup:
+#define EVENTS_MAX 64
+
+// Distinct multicast group ports to cycle through:
+#define GROUPS_MAX 256
+
+// How often to log the progress of every transfer, in milliseconds:
+#define REPORT_MS 1000
+
+// Most file descriptors one transfer holds: its socket, its file, and its background writer's notifications:
+#define FDS_PER_SESSION 3
+
+// File descriptors to leave for everything besides transfers and each worker's own two:
+#define FDS_RESERVED 16
+
+// Most transfers, waiting requests, workers, cached lookups, or read-ahead windows we'll agree to:
+#define COUNT_MAX (1u<<20)
+
+// Largest block and window sizes we're willing to negotiate:
+static size_t blksize_max;
+static unsigned windowsize_max;
+
+// Most transfers each worker will carry on at once, and requests it will hold while it's full:
+static unsigned sessions_max;
+static unsigned pending_max;
+
+// Most file descriptors and bytes of buffers all transfers together may hold (the latter 0 for no limit), and how many they do:
+static unsigned fds_max;
+static uint64_t mem_max;
+static unsigned fdsused;
+static uint64_t memused;
+
+// Whether to log each transfer's beginning, progress, and end:
+static bool verbose;
+
+// Windows of each download to read ahead of the network:
+static unsigned prefetch;
+
+// Whether to send through io_uring where the kernel supports it:
+static bool uring;
+
+// Whether to carry out transfers on the request socket rather than giving each its own:
+static bool shared;
+
+// Whether downloads must wait for bandwidth before sending:
+static bool metered;
+
+// First multicast group address and port to hand out, or a zero port if multicast is disabled:
+static struct sockaddr_in mcbase;
+static unsigned mcserial;
+
+// Every worker's statistics, and where to report them on request:
+static struct stats *allstats;
+static unsigned nstats;
+static int statsfd = -1;
+static int sigfd;
+
+static void *worker(void *);
+static void dispatch(struct worker *);
+static void handlereq(struct worker *, void *, size_t, struct sockaddr_in *);
+static bool parsereq(void *, size_t, uint16_t *, const char **, struct xferopts *);
+static bool joinsession(struct worker *, const char *, const struct xferopts *, struct sockaddr_in *);
+static void connection(struct worker *, uint16_t, const char *, const struct xferopts *, struct sockaddr_in *);
+static void service(struct worker *, struct session *);
+static bool leave(struct session *, const struct sockaddr_in *);
+static void settle(struct worker *, struct session *);
+static void endsession(struct worker *, struct session *);
+static bool room(const struct worker *);
+static bool waiting(struct worker *, const struct sockaddr_in *);
+static void admit(struct worker *);
+static void schedule(struct worker *);
+static void retime(struct worker *, struct session *);
+static unsigned hashaddr(const struct worker *, const struct sockaddr_in *);
+static struct session **bucket(struct worker *, const struct sockaddr_in *);
+static struct session *lookup(struct worker *, const struct sockaddr_in *);
+static void hashin(struct worker *, struct session *);
+static void hashout(struct worker *, struct session *);
+static void bury(struct worker *, const struct session *);
+static bool buried(const struct worker *, const struct sockaddr_in *);
+static void logsession(const struct session *, const char *);
+static void *reporter(void *);
+static bool number(const char *, unsigned long long, unsigned long long, unsigned long long *);
 static void strtolower(char *);
 
-// Runs the main loop that accepts read and write requests.
+// Starts the worker event loops that accept read and write requests and carry out the resulting transfers.
+// Accepts: command-line arguments
 // Returns: exit status
-int main(void)
+int main(int argc, char **argv)
 {
+	// Parse command-line flags:
+	blksize_max = BLKSIZE_MAX;
+	windowsize_max = 64;
+	sessions_max = 256;
+	pending_max = 256;
+	uint64_t mem_mb = 0;
+	unsigned nworkers = 1;
+	bool pin = 0;
+	size_t cache_mb = 256;
+	unsigned names_max = 256;
+	const char *statspath = NULL;
+	uint64_t sync_mb = 0;
+	uint64_t total_kb = 0;
+	uint64_t client_kb = 0;
+	prefetch = XFER_PREFETCH;
+	unsigned long long num;
+	int flag;
+	while((flag = getopt(argc, argv, "b:w:c:q:o:k:n:pm:l:A:M:s:f:a:ugPR:r:v")) != -1)
+	{
+		if(flag == 'b')
+		{
+			if(!number(optarg, BLKSIZE_MIN, BLKSIZE_MAX, &num))
+			{
+				fprintf(stderr, "%s: block size must be between %zu and %zu\n", argv[0], BLKSIZE_MIN, BLKSIZE_MAX);
+				return 1;
+			}
+			blksize_max = num;
+		}
+		else if(flag == 'w')
+		{
+			if(!number(optarg, 1, WINDOWSIZE_MAX, &num))
+			{
+				fprintf(stderr, "%s: window size must be between 1 and %u\n", argv[0], WINDOWSIZE_MAX);
+				return 1;
+			}
+			windowsize_max = num;
+		}
+		else if(flag == 'c')
+		{
+			if(!number(optarg, 1, COUNT_MAX, &num))
+			{
+				fprintf(stderr, "%s: must allow between 1 and %u concurrent transfers\n", argv[0], COUNT_MAX);
+				return 1;
+			}
+			sessions_max = num;
+		}
+		else if(flag == 'q' && number(optarg, 0, COUNT_MAX, &num))
+			pending_max = num;
+		else if(flag == 'o' && number(optarg, 0, UINT_MAX, &num))
+			fds_max = num;
+		else if(flag == 'k' && number(optarg, 0, UINT64_MAX>>20, &num))
+			mem_mb = num;
+		else if(flag == 'n')
+		{
+			if(!number(optarg, 1, COUNT_MAX, &num))
+			{
+				fprintf(stderr, "%s: must run between 1 and %u workers\n", argv[0], COUNT_MAX);
+				return 1;
+			}
+			nworkers = num;
+		}
+		else if(flag == 'p')
+			pin = 1;
+		else if(flag == 'm' && number(optarg, 0, SIZE_MAX>>20, &num))
+			cache_mb = num;
+		else if(flag == 'l' && number(optarg, 0, COUNT_MAX, &num))
+			names_max = num;
+		else if(flag == 'A')
+		{
+			if(!archiveinit(optarg))
+			{
+				fprintf(stderr, "%s: %s: %s\n", argv[0], optarg, errno ? strerror(errno) : "not a valid archive");
+				return 1;
+			}
+		}
+		else if(flag == 'M')
+		{
+			char *colon = strchr(optarg, ':');
+			mcbase.sin_family = AF_INET;
+			num = PORT_MULTICAST;
+			if(colon)
+				*colon = '\0';
+			// Successive transfers use the GROUPS_MAX ports from this one up, all of which must exist:
+			if(inet_pton(AF_INET, optarg, &mcbase.sin_addr) != 1 || !IN_MULTICAST(ntohl(mcbase.sin_addr.s_addr)) || (colon && !number(colon+1, 1, UINT16_MAX+1-GROUPS_MAX, &num)))
+			{
+				fprintf(stderr, "%s: multicast group must be a class D address and port between 1 and %d\n", argv[0], UINT16_MAX+1-GROUPS_MAX);
+				return 1;
+			}
+			mcbase.sin_port = htons(num);
+		}
+		else if(flag == 's')
+			statspath = optarg;
+		else if(flag == 'f' && number(optarg, 0, UINT64_MAX>>20, &num))
+			sync_mb = num;
+		else if(flag == 'a' && number(optarg, 0, COUNT_MAX, &num))
+			prefetch = num;
+		else if(flag == 'u')
+			uring = 1;
+		else if(flag == 'g')
+			pktnooffload();
+		else if(flag == 'P')
+			shared = 1;
+		else if(flag == 'R' && number(optarg, 0, UINT64_MAX>>10, &num))
+			total_kb = num;
+		else if(flag == 'r' && number(optarg, 0, UINT64_MAX>>10, &num))
+			client_kb = num;
+		else if(flag == 'v')
+			verbose = 1;
+		else
+		{
+			fprintf(stderr, "USAGE: %s [-b max blksize] [-w max windowsize] [-c max transfers] [-q max waiting requests] [-o max descriptors] [-k buffer MiB] [-n workers] [-p] [-m cache MiB] [-l cached lookups] [-A archive] [-M multicast group[:port]] [-s stats socket] [-f sync MiB] [-a read-ahead windows] [-u] [-g] [-P] [-R total KiB/s] [-r per-client KiB/s] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+	// Block these before starting any helper thread, since a signal delivered to a thread that hasn't blocked it would kill the server:
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	cacheinit(cache_mb<<20);
+	namesinit(names_max);
+	spoolinit(sync_mb<<20);
+	rateinit(total_kb<<10, client_kb<<10);
+	metered = total_kb || client_kb;
+
+	// Split the concurrency and queue limits among the workers, since they share nothing:
+	sessions_max = (sessions_max+nworkers-1)/nworkers;
+	pending_max = (pending_max+nworkers-1)/nworkers;
+
+	// Transfers may hold whatever descriptors the rest of the server (including the lookup cache) won't need, unless told otherwise:
+	struct rlimit rl;
+	if(!fds_max && !getrlimit(RLIMIT_NOFILE, &rl))
+	{
+		rlim_t spare = FDS_RESERVED+2*nworkers+names_max;
+		rlim_t left = rl.rlim_cur > spare ? rl.rlim_cur-spare : 0;
+		fds_max = left < UINT_MAX ? left : UINT_MAX;
+	}
+	mem_max = mem_mb<<20;
+	unsigned buckets = 1;
+	while(buckets < 2*sessions_max)
+		buckets *= 2;
+
 	// Bind to a privileged port if possible, but fall back if necessary:
-	int socketfd = openudp(PORT_PRIVILEGED);
-	if(socketfd < 0)
+	in_port_t port = PORT_PRIVILEGED;
+	int firstfd = openudp(port);
+	if(firstfd < 0)
+	{
+		port = PORT_UNPRIVILEGED;
+		firstfd = openudp(port);
+		if(firstfd < 0)
+			handle_error("bind()");
+	}
+
+	// Only once the port is ours alone may the other workers share it, lest we join another server's group and split its clients:
+	bool reuse = nworkers > 1;
+	if(reuse && setsockopt(firstfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse))
+		handle_error("setsockopt()");
+
+	// Report statistics upon SIGUSR1, which only the reporter thread will see, and to anyone who connects to the stats socket:
+	sigdelset(&sigs, SIGPIPE);
+	if((sigfd = signalfd(-1, &sigs, 0)) < 0)
+		handle_error("signalfd()");
+	if(statspath)
 	{
-		socketfd = openudp(PORT_UNPRIVILEGED);
-		if(socketfd < 0)
+		struct sockaddr_un saddr_stats = {AF_UNIX};
+		strncpy(saddr_stats.sun_path, statspath, sizeof saddr_stats.sun_path-1);
+		unlink(statspath);
+		if((statsfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(statsfd, (struct sockaddr *)&saddr_stats, sizeof saddr_stats) || listen(statsfd, 8))
+			handle_error("stats socket");
+	}
+	if(!(allstats = calloc(nworkers, sizeof *allstats)))
+		handle_error("calloc()");
+	nstats = nworkers;
+	pthread_t reporting;
+	if(pthread_create(&reporting, NULL, &reporter, NULL))
+		handle_error("pthread_create()");
+
+	// Give each worker its own request socket on that port, and optionally its own processor:
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct worker *workers = calloc(nworkers, sizeof *workers);
+	if(!workers)
+		handle_error("calloc()");
+	unsigned index;
+	for(index = 0; index < nworkers; ++index)
+	{
+		workers[index].cpu = pin ? index%ncpus : -1;
+		workers[index].stats = allstats+index;
+		workers[index].listenfd = index ? openudpr(port, 1) : firstfd;
+		if(workers[index].listenfd < 0)
 			handle_error("bind()");
+		fcntl(workers[index].listenfd, F_SETFL, O_NONBLOCK);
+		if(shared)
+			pktgro(workers[index].listenfd);
+		workers[index].table = calloc(buckets, sizeof *workers[index].table);
+		workers[index].tablemask = buckets-1;
+		workers[index].timers = calloc(sessions_max, sizeof *workers[index].timers);
+		workers[index].graves = shared ? calloc(sessions_max, sizeof *workers[index].graves) : NULL;
+		workers[index].gravetable = shared ? calloc(buckets, sizeof *workers[index].gravetable) : NULL;
+		workers[index].pending = calloc(pending_max, sizeof *workers[index].pending);
+
+		// Watch for requests, which we distinguish from transfer traffic by their lack of a session:
+		if((workers[index].epfd = epoll_create1(0)) < 0)
+			handle_error("epoll_create1()");
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(workers[index].epfd, EPOLL_CTL_ADD, workers[index].listenfd, &ev))
+			handle_error("epoll_ctl()");
 	}
 
-	// As requests are received, spawn threads or return error datagrams:
-	struct sockaddr_in saddr_remote;
+	for(index = 0; index < nworkers; ++index)
+		if(pthread_create(&workers[index].thread, NULL, &worker, workers+index))
+			handle_error("pthread_create()");
+	for(index = 0; index < nworkers; ++index)
+		pthread_join(workers[index].thread, NULL);
+
+	return 0;
+}
+
+// Runs one event loop, which starts transfers, advances them, or returns error datagrams as datagrams arrive.
+// Accepts: the worker
+// Returns: NULL
+void *worker(void *arg)
+{
+	struct worker *w = arg;
+
+	if(w->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	}
+
+	// Draw receive buffers from this thread's own pool:
+	if(!batchinit(&w->inbox, BATCH_MAX))
+		handle_error("batchinit()");
+
+	// Carry on without io_uring if it's unavailable, but say so once:
+	static unsigned unsupported;
+	if(uring && !pktring() && !__sync_fetch_and_add(&unsupported, 1))
+		fprintf(stderr, "io_uring unavailable; sending with sendmmsg() instead\n");
+
+	struct epoll_event events[EVENTS_MAX];
 	while(1)
 	{
-		// Receive each incoming request:
-		void *request = recvpkta(socketfd, &saddr_remote);
+		// Sleep until something arrives or the soonest retransmission falls due, or the scheduler has more bandwidth to hand out:
+		long long now = xferclock();
+		int timeout = -1;
+		if(w->nsessions)
+		{
+			long long left = w->timers[0]->xfer.deadline-now;
+			timeout = left > 0 ? left : 0;
+		}
+		if(w->hungry && (timeout < 0 || timeout > RATE_TICK_MS))
+			timeout = RATE_TICK_MS;
+		int nevents = epoll_wait(w->epfd, events, EVENTS_MAX, timeout);
+
+		// Hold our replies so that each socket's go out together:
+		pktcork();
 
-		// Make sure it has a request opcode:
-		uint16_t opcode = *(uint16_t *)request;
-		if(opcode == OPC_RRQ || opcode == OPC_WRQ)
+		int index;
+		for(index = 0; index < nevents; ++index)
 		{
-			// Split it up into usable chunks:
-			const char *filename = (char *)(request+2);
-			size_t fname_len = strlen(filename);
-			char *mode = (char *)(filename+fname_len+1);
-			strtolower(mode);
+			// A session's socket and its background writer are watched separately, so an earlier event in the same batch may already have ended it:
+			if(events[index].data.ptr)
+			{
+				struct session *sess = events[index].data.ptr;
+				if(!sess->dead)
+					service(w, sess);
+				continue;
+			}
 
-#ifdef DEBUG
-			fprintf(stderr, "received a request:\n");
-			if(opcode == OPC_RRQ)
-				fprintf(stderr, "opcode: RRQ\n");
-			else if(opcode == OPC_WRQ)
-				fprintf(stderr, "opcode: WRQ\n");
-			else
-				fprintf(stderr, "unexpected opcode!\n");
-			fprintf(stderr, "filename: %s\n", filename);
-			fprintf(stderr, "xfermode: %s\n", mode);
-			fprintf(stderr, "\n");
-#endif
+			// Transfers' traffic may be mixed in with the requests:
+			if(shared)
+			{
+				dispatch(w);
+				continue;
+			}
+
+			// Receive incoming requests in bulk, even when there's no room for them, so that those that can't wait are turned away promptly:
+			unsigned count = w->inbox.cap;
+			while(count == w->inbox.cap)
+			{
+				count = recvbatch(w->listenfd, &w->inbox, w->inbox.cap);
+				w->arrived = xfermicros();
+				unsigned each;
+				for(each = 0; each < count; ++each)
+					handlereq(w, batchbuf(&w->inbox, each), batchlen(&w->inbox, each), batchaddr(&w->inbox, each));
+			}
+		}
+
+		// Retransmit or give up on anyone we haven't heard from in a while, each of which either ends or is rearmed for later:
+		now = xferclock();
+		while(w->nsessions && w->timers[0]->xfer.deadline <= now)
+		{
+			struct session *due = w->timers[0];
+			xferexpire(&due->xfer);
+			settle(w, due);
+		}
+
+		// Every so often, say how everything's coming along:
+		if(verbose && now-w->reported >= REPORT_MS)
+		{
+			struct session *each;
+			for(each = w->sessions; each; each = each->next)
+				logsession(each, NULL);
+			w->reported = now;
+		}
+
+		// Start whatever requests finished transfers have made room for, then let whoever is waiting on bandwidth send what they can now afford:
+		admit(w);
+		schedule(w);
+
+		pktuncork();
+
+		// Nothing left from this round of events can refer to the sessions that ended during it:
+		while(w->dead)
+		{
+			struct session *gone = w->dead;
+			w->dead = gone->next;
+			free(gone);
+		}
+	}
+
+	return NULL;
+}
+
+// Routes everything waiting on the request socket when transfers share it, by looking up each datagram's source in the session table.  Requests are handled as usual, and anything else from a stranger gets an error.
+// Accepts: the worker
+void dispatch(struct worker *w)
+{
+	unsigned count = w->inbox.cap;
+	while(count >= w->inbox.cap)
+	{
+		count = recvbatch(w->listenfd, &w->inbox, w->inbox.cap);
+		w->arrived = xfermicros();
+		unsigned each;
+		for(each = 0; each < count; ++each)
+		{
+			const uint8_t *pkt = batchbuf(&w->inbox, each);
+			size_t len = batchlen(&w->inbox, each);
+			struct sockaddr_in *addr = batchaddr(&w->inbox, each);
+			uint16_t opc = len >= 2 ? getopc(pkt) : 0;
+			bool request = opc == OPC_RRQ || opc == OPC_WRQ;
+			struct session *sess = lookup(w, addr);
+
+			// A client can't start over from the same port until its last transfer is done with it:
+			if(sess && sess->shared && !request)
+			{
+				xferinput(&sess->xfer, pkt, len, addr);
+				settle(w, sess);
+			}
+			else if(request)
+				handlereq(w, (void *)pkt, len, addr);
+			else if(!sess && !request && opc != OPC_ERR && !buried(w, addr))
+				senderr(w->listenfd, ERR_UNKNOWNTID, addr);
+		}
+	}
+}
+
+// Validates a request and, if it makes sense, starts the transfer it asks for.
+// Accepts: the worker that received it, the request packet, its length, its source address
+void handlereq(struct worker *w, void *request, size_t req_len, struct sockaddr_in *saddr_remote)
+{
+	tally(&w->stats->requests, 1);
+
+	// A client repeats its request until it hears back, and can't start over from the same port until its last transfer is done with it, so don't start the same transfer twice:
+	if(lookup(w, saddr_remote) || waiting(w, saddr_remote))
+	{
+		tally(&w->stats->duplicates, 1);
+		return;
+	}
+
+	uint16_t opcode;
+	const char *filename;
+	struct xferopts opts;
+	if(!parsereq(request, req_len, &opcode, &filename, &opts))
+	{
+		senderr(w->listenfd, ERR_ILLEGALOPER, saddr_remote);
+		tally(&w->stats->refused, 1);
+		return;
+	}
+
+	// Joining a multicast transfer that's under way costs nothing:
+	if(opts.present & OPTF_MULTICAST && joinsession(w, filename, &opts, saddr_remote))
+		return;
 
-			// Pass all relevant data off to a separate thread:
-			pthread_t thread;
-			void *actuals = malloc(sizeof(saddr_remote)+2+fname_len+1);
-			*(struct sockaddr_in *)actuals = saddr_remote;
-			*(uint16_t *)(actuals+sizeof saddr_remote) = opcode;
-			memcpy(actuals+sizeof(saddr_remote)+2, filename, fname_len+1);
-			pthread_create(&thread, NULL, &connection, actuals);
+	// When we're full, hold on to the request until there's room, unless too many are already waiting; then it's better to say so right away than to make everyone slow:
+	if(!room(w))
+	{
+		uint8_t *copy = w->npending < pending_max ? malloc(req_len) : NULL;
+		if(copy)
+		{
+			struct pending *p = w->pending+(w->pendhead+w->npending++)%pending_max;
+			memcpy(copy, request, req_len);
+			p->addr = *saddr_remote;
+			p->req = copy;
+			p->len = req_len;
+			p->arrived = w->arrived;
+			p->seen = xferclock();
+			tally(&w->stats->queued, 1);
 		}
 		else
-			senderr(socketfd, ERR_ILLEGALOPER, &saddr_remote);
+		{
+			sendbusy(w->listenfd, saddr_remote);
+			tally(&w->stats->refused, 1);
+			tally(&w->stats->busy, 1);
+		}
+		return;
+	}
+	connection(w, opcode, filename, &opts, saddr_remote);
+}
+
+// Makes sure a request has a request opcode and properly terminated fields, and splits it up into usable chunks.  Any mode we don't translate is treated as octet, and options are trimmed to our limits.
+// Accepts: the request packet (whose mode is lowercased in place), its length, where to put its opcode, filename, and options
+// Returns: whether it was well-formed
+bool parsereq(void *request, size_t req_len, uint16_t *opcode, const char **filename, struct xferopts *opts)
+{
+	*opcode = req_len >= 2 ? getopc(request) : 0;
+	*filename = (char *)(request+2);
+	char *mode = req_len > 2 ? memchr(*filename, '\0', req_len-2) : NULL;
+	if(mode)
+		++mode;
+	char *optlist = mode ? memchr(mode, '\0', request+req_len-(void *)mode) : NULL;
+	if(optlist)
+		++optlist;
+	initopts(opts);
+	if(!(*opcode == OPC_RRQ || *opcode == OPC_WRQ) || !optlist || !parseopts(optlist, request+req_len-(void *)optlist, opts))
+		return 0;
+
+	strtolower(mode);
+	opts->netascii = !strcmp(mode, MODE_ASCII);
+	if(opts->blksize > blksize_max)
+		opts->blksize = blksize_max;
+	if(opts->windowsize > windowsize_max)
+		opts->windowsize = windowsize_max;
+	if(*opcode != OPC_RRQ || !mcbase.sin_port || opts->netascii)
+		opts->present &= ~OPTF_MULTICAST;
+
+#ifdef DEBUG
+	fprintf(stderr, "received a request:\n");
+	if(*opcode == OPC_RRQ)
+		fprintf(stderr, "opcode: RRQ\n");
+	else if(*opcode == OPC_WRQ)
+		fprintf(stderr, "opcode: WRQ\n");
+	else
+		fprintf(stderr, "unexpected opcode!\n");
+	fprintf(stderr, "filename: %s\n", *filename);
+	fprintf(stderr, "xfermode: %s\n", mode);
+	fprintf(stderr, "blksize: %zu\n", opts->blksize);
+	fprintf(stderr, "windowsize: %u\n", opts->windowsize);
+	fprintf(stderr, "timeout: %u\n", opts->timeout);
+	fprintf(stderr, "multicast: %s\n", opts->present & OPTF_MULTICAST ? "requested" : "no");
+	fprintf(stderr, "tsize: %llu\n", (unsigned long long)opts->tsize);
+	fprintf(stderr, "\n");
+#endif
+	return 1;
+}
 
-		if(request)
-			free(request);
+// Adds a client to a multicast transfer of the same file with the same options, if one is under way.  It listens to the group until its turn comes to be master.
+// Accepts: the worker, requested filename, negotiated options, the client's address
+// Returns: whether there was such a transfer
+bool joinsession(struct worker *w, const char *filename, const struct xferopts *opts, struct sockaddr_in *addr)
+{
+	struct session *each;
+	for(each = w->sessions; each; each = each->next)
+		if(each->mcfile && !strcmp(each->mcfile, filename) && each->xfer.opts.present == opts->present && each->xfer.opts.blksize == opts->blksize && each->xfer.opts.windowsize == opts->windowsize && each->xfer.opts.timeout == opts->timeout)
+			break;
+	if(!each)
+		return 0;
+
+	// Get in line, unless it's asking again because our answer was lost:
+	struct member **tail;
+	for(tail = &each->members; *tail; tail = &(*tail)->next)
+		if((*tail)->addr.sin_addr.s_addr == addr->sin_addr.s_addr && (*tail)->addr.sin_port == addr->sin_port)
+			break;
+	if(!*tail)
+	{
+		*tail = malloc(sizeof **tail);
+		(*tail)->addr = *addr;
+		(*tail)->next = NULL;
 	}
 
-	return 0;
+	struct xferopts listener = each->xfer.opts;
+	listener.master = 0;
+	sendoack(each->xfer.sfd, &listener, addr);
+	return 1;
 }
 
-// Manages each file transfer requested of the server.
-// Accepts: sockaddr_in of client, unsigned 16-bit opcode, null-terminated filename
-// Returns: NULL
-void *connection(void *args)
+// Sets up each file transfer requested of the server and adds it to the worker's event loop.
+// Accepts: the worker, unsigned 16-bit opcode, null-terminated filename, negotiated options, sockaddr_in of client
+void connection(struct worker *w, uint16_t oper, const char *filename, const struct xferopts *opts, struct sockaddr_in *rmtsocket)
 {
-	// Let's be reasonable and stop dealing with The Blob:
-	struct sockaddr_in *rmtsocket = (struct sockaddr_in *)args;
-	socklen_t rmtskt_len = sizeof(struct sockaddr_in);
-	uint16_t oper = *(uint16_t *)(args+rmtskt_len);
-	char *filename = (char *)(args+rmtskt_len+2);
+	// Find the file before anything else, so that a missing one costs no more than an error.  Readers may be spared even that lookup by the archive or the cache, whereas a writer's new file must be forgotten if it was remembered as missing:
+	int fd = -1;
+	struct stat st;
+	const uint8_t *packed = NULL;
+	size_t packedlen;
+	if(oper == OPC_RRQ && archivefind(filename, &packed, &packedlen))
+		st.st_size = packedlen;
+	else if(oper == OPC_RRQ)
+		fd = nameopen(filename, &st);
+	else if((fd = open(filename, O_WRONLY|O_CREAT|O_EXCL, 0666)) >= 0)
+		namedrop(filename);
+	if(fd < 0 && !packed)
+	{
+		diagerrno(w->listenfd, rmtsocket);
+		tally(&w->stats->refused, 1);
+		return;
+	}
 
-	// Open up an ephemeral port for the transfer:
-	int locsocket = openudp(0);
-	if(locsocket < 0)
-		handle_error("bind()");
+	// Open up an ephemeral port for the transfer, unless it can share the request socket (which multicast ones can't, since latecomers must find the master's):
+	bool own = !shared || opts->present & OPTF_MULTICAST;
+	int locsocket = w->listenfd;
+	if(own)
+	{
+		// Running out of descriptors or buffers anyway means we're overloaded, though the budgets should have prevented it:
+		if((locsocket = openudp(0)) < 0)
+		{
+			sendbusy(w->listenfd, rmtsocket);
+			if(fd >= 0)
+				close(fd);
+			if(oper == OPC_WRQ)
+				unlink(filename);
+			tally(&w->stats->refused, 1);
+			tally(&w->stats->busy, 1);
+			return;
+		}
+		fcntl(locsocket, F_SETFL, O_NONBLOCK);
+		pktgro(locsocket);
+	}
 
 #ifdef DEBUG
-	fprintf(stderr, "spawned a thread!\n");
+	fprintf(stderr, "started a session!\n");
 	fprintf(stderr, "oper: %hu\nname: %s\n", oper, filename);
 	struct sockaddr_in mysock;
 	socklen_t mysck_len = sizeof mysock;
@@ -114,29 +748,513 @@ void *connection(void *args)
 	fprintf(stderr, "\n");
 #endif
 
-	// Try to open the file for reading *or* writing, as appropriate:
-	int fd;
-	if((fd = open(filename, oper == OPC_WRQ ? O_WRONLY|O_CREAT|O_EXCL : O_RDONLY, 0666)) < 0)
+	// Tell a reader how big the file is (unless it's getting netascii, which is only translated as it goes), and make sure a writer's will fit before agreeing to take it:
+	struct xferopts granted = *opts;
+	if(granted.present & OPTF_TSIZE && oper == OPC_RRQ && opts->netascii)
+		granted.present &= ~OPTF_TSIZE;
+	else if(granted.present & OPTF_TSIZE && oper == OPC_RRQ)
+		granted.tsize = st.st_size;
+	else if(granted.present & OPTF_TSIZE && oper == OPC_WRQ && !preallocate(fd, granted.tsize))
 	{
 		diagerrno(locsocket, rmtsocket);
-		free(args);
-		return NULL;
+		flushpkts();
+		if(own)
+			close(locsocket);
+		close(fd);
+		unlink(filename);
+		tally(&w->stats->refused, 1);
+		return;
+	}
+
+	// Register the transfer and get it started:
+	struct session *sess = malloc(sizeof *sess);
+	xferinit(&sess->xfer, locsocket, fd, &granted, rmtsocket);
+	sess->mcfile = NULL;
+	sess->members = NULL;
+	sess->began = w->arrived;
+	sess->shared = !own;
+	sess->xfer.stats = w->stats;
+	sess->xfer.prefetch = prefetch;
+	sess->xfer.metered = metered;
+	sess->limit = oper == OPC_RRQ && metered ? rateget(&rmtsocket->sin_addr) : NULL;
+	sess->dead = 0;
+	tally(&w->stats->started, 1);
+
+	// Send to a group if the client asked, so long as the block numbers won't have to wrap around:
+	if(sess->xfer.opts.present & OPTF_MULTICAST)
+	{
+		if(st.st_size < (off_t)0xffff*opts->blksize)
+		{
+			sess->mcfile = strdup(filename);
+			sess->xfer.opts.group = mcbase;
+			sess->xfer.opts.group.sin_port = htons(ntohs(mcbase.sin_port)+__sync_fetch_and_add(&mcserial, 1)%GROUPS_MAX);
+			sess->xfer.opts.master = 1;
+			mcastvia(locsocket, localaddr(rmtsocket));
+		}
+		else
+			sess->xfer.opts.present &= ~OPTF_MULTICAST;
+	}
+
+	// Serve reads from memory when we can, so there's no need to keep the file open (or, for one in the archive, ever to have opened it):
+	sess->cached = oper == OPC_RRQ && !packed ? cacheget(filename, fd, &st) : NULL;
+	if(packed)
+	{
+		sess->xfer.map = packed;
+		sess->xfer.maplen = packedlen;
+	}
+	else if(sess->cached)
+	{
+		close(fd);
+		sess->xfer.fd = -1;
+		sess->xfer.map = sess->cached->data;
+		sess->xfer.maplen = sess->cached->size;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = sess;
+	if(own && epoll_ctl(w->epfd, EPOLL_CTL_ADD, locsocket, &ev))
+		handle_error("epoll_ctl()");
+
+	// Leave uploads' disk writes to the background writer, which will let us know when each is finished:
+	if(oper == OPC_WRQ && (sess->xfer.spool = spoolopen(fd)) && epoll_ctl(w->epfd, EPOLL_CTL_ADD, sess->xfer.spool->efd, &ev))
+		handle_error("epoll_ctl()");
+
+	// Charge it against the budgets for descriptors and memory, a netascii download's window of translation being in memory too:
+	sess->fds = own+(sess->xfer.fd >= 0)+(sess->xfer.spool != NULL);
+	sess->mem = sess->xfer.spool ? SPOOL_RING : 0;
+	if(oper == OPC_RRQ && opts->netascii)
+		sess->mem += xfertextmem(&sess->xfer.opts);
+	__sync_fetch_and_add(&fdsused, sess->fds);
+	__sync_fetch_and_add(&memused, sess->mem);
+
+	sess->prev = NULL;
+	sess->next = w->sessions;
+	if(w->sessions)
+		w->sessions->prev = sess;
+	w->sessions = sess;
+	sess->timer = w->nsessions;
+	w->timers[w->nsessions++] = sess;
+	hashin(w, sess);
+
+	if(verbose)
+	{
+		char note[strlen(filename)+16];
+		sprintf(note, "%s %s", oper == OPC_RRQ ? "sending" : "receiving", filename);
+		logsession(sess, note);
 	}
+	xferserve(&sess->xfer, oper);
+	retime(w, sess);
+	histadd(&w->stats->setup, xfermicros()-sess->began);
+}
 
-	// Send or receive file contents, as appropriate:
-	if(oper == OPC_RRQ)
-		sendfile(locsocket, fd, rmtsocket);
-	else // oper == OPC_WRQ
+// Feeds a transfer all the datagrams waiting on its socket, a batch at a time, and retires it once it's over.
+// Accepts: the worker that owns it, the session
+void service(struct worker *w, struct session *sess)
+{
+	// Those sharing the request socket get their datagrams from dispatch() instead:
+	unsigned count = w->inbox.cap;
+	while(!sess->shared && count == w->inbox.cap && !xferfinished(&sess->xfer))
 	{
-		sendack(locsocket, 0, rmtsocket);
-		recvfile(locsocket, fd);
+		count = recvbatch(sess->xfer.sfd, &w->inbox, w->inbox.cap);
+		unsigned each;
+		for(each = 0; each < count; ++each)
+			if(!sess->mcfile || !leave(sess, batchaddr(&w->inbox, each)))
+				xferinput(&sess->xfer, batchbuf(&w->inbox, each), batchlen(&w->inbox, each), batchaddr(&w->inbox, each));
 	}
 
-	close(fd);
-	free(args);
+	// This may also have been the background writer reporting back:
+	xferflushed(&sess->xfer);
+	settle(w, sess);
+}
+
+// Drops a client from a multicast group's waiting list, since those not yet master only speak up once they're done (or giving up).
+// Accepts: the session, the source of a datagram it received
+// Returns: whether the source was on the list
+bool leave(struct session *sess, const struct sockaddr_in *from)
+{
+	struct member **link;
+	for(link = &sess->members; *link; link = &(*link)->next)
+		if((*link)->addr.sin_addr.s_addr == from->sin_addr.s_addr && (*link)->addr.sin_port == from->sin_port)
+		{
+			struct member *gone = *link;
+			*link = gone->next;
+			free(gone);
+			return 1;
+		}
+	return 0;
+}
+
+// Moves a session to its place in its worker's heap of deadlines, which may have changed since it was last there.
+// Accepts: the worker, the session
+void retime(struct worker *w, struct session *sess)
+{
+	// Move it up past any parents due later, or else down past any children due sooner:
+	unsigned at = sess->timer;
+	while(at && w->timers[(at-1)/2]->xfer.deadline > sess->xfer.deadline)
+	{
+		w->timers[at] = w->timers[(at-1)/2];
+		w->timers[at]->timer = at;
+		at = (at-1)/2;
+	}
+	unsigned child;
+	while((child = 2*at+1) < w->nsessions)
+	{
+		if(child+1 < w->nsessions && w->timers[child+1]->xfer.deadline < w->timers[child]->xfer.deadline)
+			++child;
+		if(w->timers[child]->xfer.deadline >= sess->xfer.deadline)
+			break;
+		w->timers[at] = w->timers[child];
+		w->timers[at]->timer = at;
+		at = child;
+	}
+	w->timers[at] = sess;
+	sess->timer = at;
+}
+
+// Hashes a client's address and port.
+// Accepts: the worker, the client's address
+// Returns: the index of its bucket in the worker's tables
+unsigned hashaddr(const struct worker *w, const struct sockaddr_in *addr)
+{
+	uint32_t key = ntohl(addr->sin_addr.s_addr)*0x9e3779b1u^ntohs(addr->sin_port);
+	return (key*0x85ebca6bu)>>16&w->tablemask;
+}
+
+// Finds where a client's session would be in a worker's table.
+// Accepts: the worker, the client's address
+// Returns: the head of its bucket
+struct session **bucket(struct worker *w, const struct sockaddr_in *addr)
+{
+	return w->table+hashaddr(w, addr);
+}
+
+// Finds the session serving a client.
+// Accepts: the worker, the client's address
+// Returns: the session, or NULL if it has none
+struct session *lookup(struct worker *w, const struct sockaddr_in *addr)
+{
+	struct session *each;
+	for(each = *bucket(w, addr); each; each = each->hnext)
+		if(each->xfer.peer.sin_addr.s_addr == addr->sin_addr.s_addr && each->xfer.peer.sin_port == addr->sin_port)
+			return each;
 	return NULL;
 }
 
+// Adds a session to its worker's table under its client's address.
+// Accepts: the worker, the session
+void hashin(struct worker *w, struct session *sess)
+{
+	struct session **head = bucket(w, &sess->xfer.peer);
+	sess->hnext = *head;
+	*head = sess;
+}
+
+// Removes a session from its worker's table, which must happen before its client changes.
+// Accepts: the worker, the session
+void hashout(struct worker *w, struct session *sess)
+{
+	struct session **link;
+	for(link = bucket(w, &sess->xfer.peer); *link; link = &(*link)->hnext)
+		if(*link == sess)
+		{
+			*link = sess->hnext;
+			return;
+		}
+}
+
+// Remembers a client whose transfer on the request socket just ended, since its duplicates and retransmissions may still be on their way.  Had the transfer had its own socket, they'd have gone unanswered, so an error now could abort the client while it dallies.
+// Accepts: the worker, the session
+void bury(struct worker *w, const struct session *sess)
+{
+	struct grave *g = w->graves+w->nextgrave++%sessions_max;
+
+	// The oldest grave is reused, so it must first leave the table:
+	struct grave **link;
+	if(g->until)
+	{
+		for(link = w->gravetable+hashaddr(w, &g->addr); *link != g; link = &(*link)->hnext);
+		*link = g->hnext;
+	}
+
+	g->addr = sess->xfer.peer;
+	g->until = xferclock()+3*XFER_RTO_MAX_MS;
+	link = w->gravetable+hashaddr(w, &g->addr);
+	g->hnext = *link;
+	*link = g;
+}
+
+// Checks whether a client's transfer on the request socket ended recently.
+// Accepts: the worker, the client's address
+// Returns: whether it did
+bool buried(const struct worker *w, const struct sockaddr_in *addr)
+{
+	long long now = xferclock();
+	const struct grave *each;
+	for(each = w->gravetable[hashaddr(w, addr)]; each; each = each->hnext)
+		if(each->until > now && each->addr.sin_addr.s_addr == addr->sin_addr.s_addr && each->addr.sin_port == addr->sin_port)
+			return 1;
+	return 0;
+}
+
+// Retires a transfer once it's over, unless it's multicast and another client is waiting to take over as master.
+// Accepts: the worker that owns it, the session
+void settle(struct worker *w, struct session *sess)
+{
+	if(!xferfinished(&sess->xfer))
+	{
+		retime(w, sess);
+		return;
+	}
+
+	if(sess->members)
+	{
+		struct member *next = sess->members;
+		sess->members = next->next;
+		hashout(w, sess);
+		xferpass(&sess->xfer, &next->addr);
+		hashin(w, sess);
+		retime(w, sess);
+		free(next);
+	}
+	else
+		endsession(w, sess);
+}
+
+// Tears down a transfer and releases everything associated with it.
+// Accepts: the worker that owns it, the session
+void endsession(struct worker *w, struct session *sess)
+{
+#ifdef DEBUG
+	fprintf(stderr, "ended a session: %s\n\n", sess->xfer.error ? sess->xfer.error : "success");
+#endif
+
+	if(sess->xfer.error)
+		tally(&w->stats->failed, 1);
+	else
+	{
+		tally(&w->stats->succeeded, 1);
+		histadd(&w->stats->total, xfermicros()-sess->began);
+	}
+	if(verbose)
+		logsession(sess, NULL);
+
+	// Any parting words must leave before the socket closes:
+	flushpkts();
+	if(sess->shared)
+		bury(w, sess);
+	else
+	{
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, sess->xfer.sfd, NULL);
+		close(sess->xfer.sfd);
+	}
+	hashout(w, sess);
+	if(sess->xfer.spool)
+	{
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, sess->xfer.spool->efd, NULL);
+		spoolclose(sess->xfer.spool);
+	}
+	if(sess->cached)
+		cacheput(sess->cached);
+	else if(sess->xfer.fd >= 0)
+		close(sess->xfer.fd);
+	free(sess->xfer.text);
+
+	while(sess->members)
+	{
+		struct member *next = sess->members->next;
+		free(sess->members);
+		sess->members = next;
+	}
+	free(sess->mcfile);
+	rateput(sess->limit);
+	__sync_fetch_and_sub(&fdsused, sess->fds);
+	__sync_fetch_and_sub(&memused, sess->mem);
+
+	if(w->turn == sess)
+		w->turn = sess->next;
+	if(sess->prev)
+		sess->prev->next = sess->next;
+	else
+		w->sessions = sess->next;
+	if(sess->next)
+		sess->next->prev = sess->prev;
+
+	// Fill its place in the heap with the last one there:
+	struct session *last = w->timers[--w->nsessions];
+	if(last != sess)
+	{
+		last->timer = sess->timer;
+		w->timers[last->timer] = last;
+		retime(w, last);
+	}
+
+	// Events for it may still be waiting to be handled, so its memory must outlive them:
+	sess->dead = 1;
+	sess->next = w->dead;
+	w->dead = sess;
+}
+
+// Determines whether a worker has room for another transfer, within both its concurrency limit and the whole server's budgets for descriptors and memory.  The memory budget is only checked before each transfer starts, so the last one may overshoot it.
+// Accepts: the worker
+// Returns: the answer
+bool room(const struct worker *w)
+{
+	return w->nsessions < sessions_max && __atomic_load_n(&fdsused, __ATOMIC_RELAXED)+FDS_PER_SESSION <= fds_max && (!mem_max || __atomic_load_n(&memused, __ATOMIC_RELAXED) < mem_max);
+}
+
+// Checks whether a client already has a request waiting for room, noting that it's still around to be served.
+// Accepts: the worker, the client's address
+// Returns: whether it does
+bool waiting(struct worker *w, const struct sockaddr_in *addr)
+{
+	unsigned each;
+	for(each = 0; each < w->npending; ++each)
+	{
+		struct pending *p = w->pending+(w->pendhead+each)%pending_max;
+		if(p->addr.sin_addr.s_addr == addr->sin_addr.s_addr && p->addr.sin_port == addr->sin_port)
+		{
+			p->seen = xferclock();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Starts as many waiting requests as there's now room for, oldest first.  Those whose clients haven't repeated them in so long that they must have given up are dropped instead.
+// Accepts: the worker
+void admit(struct worker *w)
+{
+	long long now = xferclock();
+	while(w->npending)
+	{
+		struct pending *p = w->pending+w->pendhead;
+		bool stale = now-p->seen > 2*XFER_RTO_MAX_MS;
+		if(!stale && !room(w))
+			break;
+		w->pendhead = (w->pendhead+1)%pending_max;
+		--w->npending;
+
+		// It was well-formed when it arrived, and its setup time includes the wait:
+		uint16_t opcode;
+		const char *filename;
+		struct xferopts opts;
+		if(!stale && parsereq(p->req, p->len, &opcode, &filename, &opts))
+		{
+			w->arrived = p->arrived;
+			if(!(opts.present & OPTF_MULTICAST && joinsession(w, filename, &opts, &p->addr)))
+				connection(w, opcode, filename, &opts, &p->addr);
+		}
+		free(p->req);
+	}
+}
+
+// Hands out bandwidth a block at a time to the transfers waiting for it, taking turns so that bulk downloads can't crowd out small ones.  Rounds continue until everyone is satisfied or out of budget, and once the server as a whole runs out, the next call picks up where this one left off.
+// Accepts: the worker
+void schedule(struct worker *w)
+{
+	if(!metered)
+		return;
+
+	bool progress = 1;
+	bool hungry = 0;
+	while(progress)
+	{
+		progress = 0;
+		hungry = 0;
+		struct session *sess = w->turn ? w->turn : w->sessions;
+		unsigned each;
+		for(each = 0; each < w->nsessions; ++each)
+		{
+			struct session *next = sess->next ? sess->next : w->sessions;
+			size_t want = 4+sess->xfer.opts.blksize;
+			if(xferstarved(&sess->xfer) && sess->xfer.allowance < want)
+			{
+				int granted = ratetake(sess->limit, want-sess->xfer.allowance);
+				if(granted < 0)
+				{
+					w->turn = sess;
+					w->hungry = 1;
+					return;
+				}
+				if(granted)
+				{
+					sess->xfer.allowance = want;
+					xferresume(&sess->xfer);
+					retime(w, sess);
+					progress = 1;
+				}
+				else
+					hungry = 1;
+			}
+			sess = next;
+		}
+	}
+	w->turn = NULL;
+	w->hungry = hungry;
+}
+
+// Logs a line about a transfer to standard error, which is either a note or else how far along it is and, if it's over, how it ended.
+// Accepts: the session, the note or NULL
+void logsession(const struct session *sess, const char *note)
+{
+	char status[128];
+	if(!note)
+	{
+		xferstatus(&sess->xfer, status, sizeof status);
+		note = status;
+	}
+
+	char addr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &sess->xfer.peer.sin_addr, addr, sizeof addr);
+	fprintf(stderr, "%s:%hu: %s%s%s\n", addr, ntohs(sess->xfer.peer.sin_port), note,
+			sess->xfer.error ? ", failed: " : sess->xfer.state == XFER_DONE ? ", done" : "", sess->xfer.error ? sess->xfer.error : "");
+}
+
+// Writes every worker's statistics to standard error upon SIGUSR1, or to whoever connects to the stats socket (if any).
+// Returns: NULL
+void *reporter(void *unused)
+{
+	struct pollfd pfds[2] = {{sigfd, POLLIN}, {statsfd, POLLIN}};
+	while(1)
+	{
+		if(poll(pfds, 2, -1) < 0)
+			continue;
+
+		if(pfds[0].revents)
+		{
+			struct signalfd_siginfo info;
+			if(read(sigfd, &info, sizeof info) == sizeof info)
+				dumpstats(stderr, allstats, nstats);
+		}
+		if(pfds[1].revents)
+		{
+			int conn = accept(statsfd, NULL, NULL);
+			FILE *out = conn >= 0 ? fdopen(conn, "w") : NULL;
+			if(out)
+			{
+				dumpstats(out, allstats, nstats);
+				fclose(out);
+			}
+			else if(conn >= 0)
+				close(conn);
+		}
+	}
+
+	return NULL;
+}
+
+// Parses a nonnegative number given on the command line, in decimal, octal, or hexadecimal.
+// Accepts: the argument, the least and greatest acceptable values, where to store the number
+// Returns: whether the whole argument was a number within range
+bool number(const char *arg, unsigned long long min, unsigned long long max, unsigned long long *num)
+{
+	char *end;
+	errno = 0;
+	*num = strtoull(arg, &end, 0);
+	return isdigit((unsigned char) *arg) && !*end && !errno && *num >= min && *num <= max;
+}
+
 // Converts a string to lowercase in-place.
 // Accepts: null-terminated string
 void strtolower(char *a)
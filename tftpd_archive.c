@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Archive implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftpd_archive.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char ARCHIVE_MAGIC[8] = "TFTPARC1";
+
+// The whole archive as mapped, and its index:
+static const uint8_t *base;
+static size_t baselen;
+static const struct arcent *toc;
+static size_t entries;
+
+// Maps an archive into memory, checking that everything its index points to lies within it, so that lookups can trust it.  The mapping keeps the file it was made from, even if a new archive is later renamed over it.  Any archive mapped before is replaced, which must happen before anything is served from it.
+// Accepts: its pathname
+// Returns: whether it was usable, with errno set if the problem was opening it
+bool archiveinit(const char *path)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return 0;
+	struct stat st;
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(struct archead))
+	{
+		close(fd);
+		errno = 0;
+		return 0;
+	}
+	const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 0;
+	errno = 0;
+
+	// Check the header and index:
+	const struct archead *head = (const struct archead *)map;
+	uint64_t count = le64toh(head->count);
+	size_t len = st.st_size;
+	bool ok = !memcmp(head->magic, ARCHIVE_MAGIC, sizeof head->magic) && count <= (len-sizeof *head)/sizeof(struct arcent);
+	const struct arcent *ents = (const struct arcent *)(head+1);
+	const char *prev = NULL;
+	uint64_t each;
+	for(each = 0; ok && each < count; ++each)
+	{
+		uint64_t name = le64toh(ents[each].name);
+		uint64_t data = le64toh(ents[each].data);
+		uint64_t size = le64toh(ents[each].size);
+		const char *cur = (const char *)map+name;
+		ok = name < len && memchr(cur, '\0', len-name) && data <= len && size <= len-data && (!prev || strcmp(prev, cur) < 0);
+		prev = cur;
+	}
+	if(!ok)
+	{
+		munmap((void *)map, len);
+		return 0;
+	}
+
+	if(base)
+		munmap((void *)base, baselen);
+	base = map;
+	baselen = len;
+	toc = ents;
+	entries = count;
+	return 1;
+}
+
+// Looks up a file in the archive by binary search.
+// Accepts: its pathname, where to put its contents and their length
+// Returns: whether it was found, which it never is if there's no archive
+bool archivefind(const char *path, const uint8_t **data, size_t *len)
+{
+	size_t lo = 0;
+	size_t hi = entries;
+	while(lo < hi)
+	{
+		size_t mid = lo+(hi-lo)/2;
+		int cmp = strcmp(path, (const char *)base+le64toh(toc[mid].name));
+		if(!cmp)
+		{
+			*data = base+le64toh(toc[mid].data);
+			*len = le64toh(toc[mid].size);
+			return 1;
+		}
+		if(cmp < 0)
+			hi = mid;
+		else
+			lo = mid+1;
+	}
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Read-only archive of many files in one, which the server can serve straight out of memory.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTPD_ARCHIVE_H
+#define TFTPD_ARCHIVE_H
+
+#include "tftp_protoc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// An archive starts with this header, followed by its index, then the pathnames, then the contents.  All numbers are little-endian, and all offsets are from the start of the archive.
+struct archead
+{
+	char magic[8]; // ARCHIVE_MAGIC
+	uint64_t count; // Entries in the index
+};
+
+// One file, in an index sorted by pathname as compared by strcmp():
+struct arcent
+{
+	uint64_t name; // Offset of its NUL-terminated pathname
+	uint64_t data; // Offset of its contents
+	uint64_t size; // Length of its contents
+};
+
+extern const char ARCHIVE_MAGIC[8];
+
+bool archiveinit(const char *);
+bool archivefind(const char *, const uint8_t **, size_t *);
+
+#endif
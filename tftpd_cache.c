@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Memory-mapped file cache implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftpd_cache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Number of hash table buckets:
+#define BUCKETS 1024
+
+// Most bytes to keep mapped on the cache's behalf, and how many currently are:
+static size_t budget;
+static size_t used;
+
+// Entries indexed by path, and ordered from most to least recently used:
+static struct cachent *buckets[BUCKETS];
+static struct cachent *newest;
+static struct cachent *oldest;
+
+// Guards all of the above, though it's only taken when transfers start and finish:
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash(const char *);
+static void touch(struct cachent *);
+static void detach(struct cachent *);
+static void release(struct cachent *);
+
+// Sets the cache's memory budget.
+// Accepts: the most bytes of file contents to keep mapped, or 0 to disable caching
+void cacheinit(size_t bytes)
+{
+	budget = bytes;
+}
+
+// Looks up a file's contents, mapping them if they aren't cached or have changed since they were.  Should the file be truncated in place while it's being served, senders find out when they next copy from the mapping, and give up on it.
+// Accepts: its path, a file descriptor open on it for reading, the file's metadata
+// Returns: a reference to be released with cacheput(), or NULL if the file can't be cached
+const struct cachent *cacheget(const char *path, int fd, const struct stat *st)
+{
+	if(!budget || !S_ISREG(st->st_mode) || !st->st_size || st->st_size > budget)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	unsigned bucket = hash(path);
+	struct cachent *ent;
+	for(ent = buckets[bucket]; ent && strcmp(ent->path, path); ent = ent->hnext);
+
+	// Forget about any version that's out of date:
+	if(ent && (ent->dev != st->st_dev || ent->ino != st->st_ino || ent->size != st->st_size || ent->mtime.tv_sec != st->st_mtim.tv_sec || ent->mtime.tv_nsec != st->st_mtim.tv_nsec))
+	{
+		detach(ent);
+		ent = NULL;
+	}
+
+	if(ent)
+		touch(ent);
+	else
+	{
+		void *data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED)
+		{
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+
+		// Make room by evicting whatever has gone unused the longest:
+		while(used+st->st_size > budget && oldest)
+			detach(oldest);
+
+		ent = calloc(1, sizeof *ent);
+		ent->data = data;
+		ent->size = st->st_size;
+		ent->path = strdup(path);
+		ent->dev = st->st_dev;
+		ent->ino = st->st_ino;
+		ent->mtime = st->st_mtim;
+		ent->refs = 1;
+		ent->hnext = buckets[bucket];
+		buckets[bucket] = ent;
+		touch(ent);
+		used += ent->size;
+	}
+
+	++ent->refs;
+	pthread_mutex_unlock(&lock);
+	return ent;
+}
+
+// Releases a reference obtained from cacheget().
+// Accepts: the entry
+void cacheput(const struct cachent *ent)
+{
+	pthread_mutex_lock(&lock);
+	release((struct cachent *)ent);
+	pthread_mutex_unlock(&lock);
+}
+
+// Hashes a path using FNV-1a.
+// Accepts: the path
+// Returns: its bucket
+unsigned hash(const char *path)
+{
+	uint32_t sum = 2166136261u;
+	for(; *path; ++path)
+		sum = (sum^(uint8_t)*path)*16777619u;
+	return sum%BUCKETS;
+}
+
+// Marks an entry as the most recently used.
+// Accepts: the entry, which may or may not already be in the recency list
+void touch(struct cachent *ent)
+{
+	if(ent == newest)
+		return;
+
+	// Unlink it from wherever it was:
+	if(ent->older)
+		ent->older->newer = ent->newer;
+	if(ent->newer)
+		ent->newer->older = ent->older;
+	if(ent == oldest)
+		oldest = ent->newer;
+
+	ent->newer = NULL;
+	ent->older = newest;
+	if(newest)
+		newest->newer = ent;
+	newest = ent;
+	if(!oldest)
+		oldest = ent;
+}
+
+// Removes an entry from the cache, though any transfers still using it may continue to do so.
+// Accepts: the entry
+void detach(struct cachent *ent)
+{
+	struct cachent **link;
+	for(link = buckets+hash(ent->path); *link != ent; link = &(*link)->hnext);
+	*link = ent->hnext;
+
+	if(ent->older)
+		ent->older->newer = ent->newer;
+	else
+		oldest = ent->newer;
+	if(ent->newer)
+		ent->newer->older = ent->older;
+	else
+		newest = ent->older;
+
+	used -= ent->size;
+	release(ent);
+}
+
+// Drops a reference to an entry, unmapping it once nobody needs it.
+// Accepts: the entry
+void release(struct cachent *ent)
+{
+	if(--ent->refs)
+		return;
+
+	munmap((void *)ent->data, ent->size);
+	free(ent->path);
+	free(ent);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Memory-mapped file cache shared by all of the server's transfers.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTPD_CACHE_H
+#define TFTPD_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+// A file's contents mapped into memory, which stays valid until released even if it's evicted:
+struct cachent
+{
+	const uint8_t *data;
+	size_t size;
+	char *path;
+	dev_t dev; // Identity and version of the file that was mapped
+	ino_t ino;
+	struct timespec mtime;
+	unsigned refs; // Transfers using it, plus one while it's in the cache
+	struct cachent *hnext; // Next in the same hash bucket
+	struct cachent *newer; // Neighbors in order of use
+	struct cachent *older;
+};
+
+void cacheinit(size_t);
+const struct cachent *cacheget(const char *, int, const struct stat *);
+void cacheput(const struct cachent *);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// File lookup cache implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftpd_names.h"
+#include "tftp_protoc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// A directory being watched because it contains cached names:
+struct namedir
+{
+	int wd; // Its watch
+	unsigned refs; // Entries in it
+	struct nament *entries; // All of them
+	struct namedir *hnext; // Next in the same hash bucket
+};
+
+// What looking up one pathname found, or is in the middle of finding:
+struct nament
+{
+	char *path;
+	const char *name; // Its last component
+	struct namedir *dir; // The directory containing it
+	unsigned long serial; // Identifies this entry, and not any later one for the same pathname
+	bool ready; // Whether the lookup has finished and the rest is filled in
+	int fd; // Open for reading, or -1 if there's no such file
+	struct stat st;
+	long long expires; // When to stop trusting it, in monotonic milliseconds
+	struct nament *hnext; // Next in the same bucket by pathname
+	struct nament *wnext; // Next in the same bucket by directory and name
+	struct nament *dnext; // Neighbors in the same directory
+	struct nament *dprev;
+	struct nament *newer; // Neighbors in order of use
+	struct nament *older;
+};
+
+// Number of buckets in each hash table:
+#define BUCKETS 1024
+
+// How long to trust an entry, in case a change escapes inotify (as when an ancestor of its directory is renamed), in milliseconds:
+#define TTL_MS 10000
+
+// Changes to watch each directory for, any of which could change what a name in it refers to or how big it is:
+#define WATCHED (IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+// Most entries to keep, how many there are, and how many have ever been made:
+static unsigned capacity;
+static unsigned count;
+static unsigned long serials;
+
+// Entries indexed by pathname and by where inotify will report changes to them, and ordered from most to least recently used:
+static struct nament *bypath[BUCKETS];
+static struct nament *bywatch[BUCKETS];
+static struct nament *newest;
+static struct nament *oldest;
+
+// Watched directories, indexed by watch descriptor:
+static struct namedir *dirs[BUCKETS];
+
+// Where changes are reported:
+static int ifd = -1;
+
+// Guards all of the above:
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long millis(void);
+static unsigned hash(uint32_t, const char *);
+static struct nament *find(const char *);
+static struct namedir *watch(const char *);
+static void touch(struct nament *);
+static void detach(struct nament *);
+static void *watcher(void *);
+
+// Sets the cache's size, starting the thread that watches for changes if it's to be used at all.
+// Accepts: the most entries to keep, each of which may hold a file descriptor and a directory watch, or 0 to disable caching
+void namesinit(unsigned entries)
+{
+	if(!entries)
+		return;
+	if((ifd = inotify_init1(IN_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "inotify unavailable; not caching file lookups\n");
+		return;
+	}
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, &watcher, NULL))
+		handle_error("pthread_create()");
+	pthread_detach(thread);
+	capacity = entries;
+}
+
+// Opens a file for reading, by way of the cache if possible.  What's found is remembered so long as its directory can be watched, and a file that doesn't exist is remembered as such.
+// Accepts: its pathname, where to put its metadata
+// Returns: a new file descriptor, or -1 with errno set
+int nameopen(const char *path, struct stat *st)
+{
+	// Use what we already know if it's recent enough:
+	long long now = millis();
+	pthread_mutex_lock(&lock);
+	struct nament *ent = find(path);
+	if(ent && ent->ready && ent->expires <= now)
+	{
+		detach(ent);
+		ent = NULL;
+	}
+	if(ent && ent->ready)
+	{
+		touch(ent);
+		int fd = ent->fd >= 0 ? dup(ent->fd) : -1;
+		if(ent->fd < 0)
+			errno = ENOENT;
+		else
+			*st = ent->st;
+		pthread_mutex_unlock(&lock);
+		return fd;
+	}
+
+	// Otherwise, hold a place for the answer (unless someone else already is), watching its directory first so that any change from here on removes the placeholder:
+	unsigned long serial = 0;
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash+1 : path;
+	if(!ent && capacity && *name && (ent = calloc(1, sizeof *ent)) && (ent->path = strdup(path)))
+	{
+		char dir[slash ? slash-path+2 : 2];
+		if(slash)
+		{
+			memcpy(dir, path, slash-path+1);
+			dir[slash == path ? 1 : slash-path] = '\0';
+		}
+		else
+			strcpy(dir, ".");
+
+		while(count >= capacity && oldest)
+			detach(oldest);
+		if((ent->dir = watch(dir)))
+		{
+			ent->name = ent->path+(name-path);
+			ent->serial = serial = ++serials;
+			ent->fd = -1;
+			unsigned bucket = hash(0, path);
+			ent->hnext = bypath[bucket];
+			bypath[bucket] = ent;
+			bucket = hash(ent->dir->wd, name);
+			ent->wnext = bywatch[bucket];
+			bywatch[bucket] = ent;
+			ent->dnext = ent->dir->entries;
+			if(ent->dnext)
+				ent->dnext->dprev = ent;
+			ent->dir->entries = ent;
+			++ent->dir->refs;
+			touch(ent);
+			++count;
+			ent = NULL;
+		}
+	}
+	if(ent)
+	{
+		free(ent->path);
+		free(ent);
+	}
+	pthread_mutex_unlock(&lock);
+
+	int fd = open(path, O_RDONLY);
+	if(fd >= 0 && fstat(fd, st))
+	{
+		close(fd);
+		fd = -1;
+	}
+	int err = errno;
+	if(!serial)
+	{
+		errno = err;
+		return fd;
+	}
+
+	// Fill in the placeholder if it's still there, which it won't be if anything changed in the meantime:
+	pthread_mutex_lock(&lock);
+	if((ent = find(path)) && ent->serial == serial)
+	{
+		int keep = fd >= 0 ? dup(fd) : -1;
+		if((fd < 0 && err != ENOENT) || (fd >= 0 && keep < 0))
+			detach(ent);
+		else
+		{
+			ent->ready = 1;
+			ent->fd = keep;
+			if(fd >= 0)
+				ent->st = *st;
+			ent->expires = now+TTL_MS;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	errno = err;
+	return fd;
+}
+
+// Forgets what's known about a pathname, for when the server itself has just created it.
+// Accepts: the pathname
+void namedrop(const char *path)
+{
+	pthread_mutex_lock(&lock);
+	struct nament *ent = find(path);
+	if(ent)
+		detach(ent);
+	pthread_mutex_unlock(&lock);
+}
+
+// Reads the monotonic clock.
+// Returns: the time in milliseconds
+long long millis(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000LL+now.tv_nsec/1000000;
+}
+
+// Hashes a name using FNV-1a, optionally qualified by a watch descriptor.
+// Accepts: the watch descriptor or 0, the name
+// Returns: its bucket
+unsigned hash(uint32_t wd, const char *name)
+{
+	uint32_t sum = 2166136261u^wd;
+	for(; *name; ++name)
+		sum = (sum^(uint8_t)*name)*16777619u;
+	return sum%BUCKETS;
+}
+
+// Looks up an entry, whether or not it's ready.  The lock must be held.
+// Accepts: its pathname
+// Returns: the entry, or NULL if there isn't one
+struct nament *find(const char *path)
+{
+	struct nament *ent;
+	for(ent = bypath[hash(0, path)]; ent && strcmp(ent->path, path); ent = ent->hnext);
+	return ent;
+}
+
+// Starts watching a directory, or finds the existing watch, which lasts until its last entry is detached.  The lock must be held, so that no change the watch reports can be processed before the caller's entry is in place.
+// Accepts: its pathname
+// Returns: the directory, or NULL if it can't be watched
+struct namedir *watch(const char *path)
+{
+	int wd = inotify_add_watch(ifd, path, WATCHED);
+	if(wd < 0)
+		return NULL;
+
+	struct namedir **link;
+	for(link = dirs+wd%BUCKETS; *link && (*link)->wd != wd; link = &(*link)->hnext);
+	if(!*link && (*link = calloc(1, sizeof **link)))
+		(*link)->wd = wd;
+	else if(!*link)
+		inotify_rm_watch(ifd, wd);
+	return *link;
+}
+
+// Marks an entry as the most recently used.  The lock must be held.
+// Accepts: the entry, which may or may not already be in the recency list
+void touch(struct nament *ent)
+{
+	if(ent == newest)
+		return;
+
+	// Unlink it from wherever it was:
+	if(ent->older)
+		ent->older->newer = ent->newer;
+	if(ent->newer)
+		ent->newer->older = ent->older;
+	if(ent == oldest)
+		oldest = ent->newer;
+
+	ent->newer = NULL;
+	ent->older = newest;
+	if(newest)
+		newest->newer = ent;
+	newest = ent;
+	if(!oldest)
+		oldest = ent;
+}
+
+// Removes an entry from the cache and frees it, along with its directory's watch if nothing else there is cached.  The lock must be held.
+// Accepts: the entry
+void detach(struct nament *ent)
+{
+	struct nament **link;
+	for(link = bypath+hash(0, ent->path); *link != ent; link = &(*link)->hnext);
+	*link = ent->hnext;
+	for(link = bywatch+hash(ent->dir->wd, ent->name); *link != ent; link = &(*link)->wnext);
+	*link = ent->wnext;
+
+	if(ent->newer)
+		ent->newer->older = ent->older;
+	else
+		newest = ent->older;
+	if(ent->older)
+		ent->older->newer = ent->newer;
+	else
+		oldest = ent->newer;
+
+	struct namedir *dir = ent->dir;
+	if(ent->dnext)
+		ent->dnext->dprev = ent->dprev;
+	if(ent->dprev)
+		ent->dprev->dnext = ent->dnext;
+	else
+		dir->entries = ent->dnext;
+	if(!--dir->refs)
+	{
+		struct namedir **dlink;
+		for(dlink = dirs+dir->wd%BUCKETS; *dlink != dir; dlink = &(*dlink)->hnext);
+		*dlink = dir->hnext;
+		inotify_rm_watch(ifd, dir->wd);
+		free(dir);
+	}
+
+	if(ent->fd >= 0)
+		close(ent->fd);
+	free(ent->path);
+	free(ent);
+	--count;
+}
+
+// Forgets every entry that inotify says may have changed, for as long as the program runs.  A directory that's gone or moved takes all of its entries with it, and if the kernel lost track of events, everything goes.  Changes to names nobody has cached cost only a lookup.
+// Returns: never
+void *watcher(void *unused)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(1)
+	{
+		ssize_t len = read(ifd, buf, sizeof buf);
+		if(len <= 0)
+			continue;
+
+		pthread_mutex_lock(&lock);
+		const struct inotify_event *ev;
+		for(ev = (void *)buf; (char *)ev < buf+len; ev = (void *)((char *)ev+sizeof *ev+ev->len))
+		{
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				while(newest)
+					detach(newest);
+				continue;
+			}
+
+			struct namedir *dir;
+			for(dir = dirs[ev->wd%BUCKETS]; dir && dir->wd != ev->wd; dir = dir->hnext);
+			if(!dir)
+				continue;
+			if(!ev->len || ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+			{
+				// The last of these frees the directory:
+				unsigned left = dir->refs;
+				while(left--)
+					detach(dir->entries);
+				continue;
+			}
+
+			struct nament *ent;
+			struct nament *next;
+			for(ent = bywatch[hash(ev->wd, ev->name)]; ent; ent = next)
+			{
+				next = ent->wnext;
+				if(ent->dir == dir && !strcmp(ent->name, ev->name))
+					detach(ent);
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
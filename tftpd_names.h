@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Cache of the files that transfers ask for by name, which remembers each one's open descriptor and metadata (or that it doesn't exist) until inotify says it's changed.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTPD_NAMES_H
+#define TFTPD_NAMES_H
+
+#include <sys/stat.h>
+
+void namesinit(unsigned);
+int nameopen(const char *, struct stat *);
+void namedrop(const char *);
+
+#endif
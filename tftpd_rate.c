@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bandwidth cap implementation.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftpd_rate.h"
+#include "tftp_protoc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Bytes that may be sent at any given moment, which fills back up over time.  Rather than counting what's left, it records when everything spent will have been earned back, so that a single compare-and-swap can spend from it:
+struct ratebucket
+{
+	long long due; // When it will be out of debt, in monotonic nanoseconds; a burst's worth earlier means it's full
+	uint64_t rate; // Bytes per second, or 0 for no limit
+	in_addr_t addr; // Client it's for
+	unsigned refs; // Transfers to that client
+	struct ratebucket *hnext; // Next in the same hash bucket
+};
+
+// Number of hash table buckets:
+#define BUCKETS 256
+
+// How long a burst each bucket may save up for, in milliseconds:
+#define BURST_MS 10
+
+const int RATE_TICK_MS = 1;
+
+// The server's bucket, and the rate to give each client's:
+static struct ratebucket total;
+static uint64_t each;
+
+// What this thread has borrowed from the server's bucket but not yet spent, which may go negative to overdraw it:
+static __thread double credit;
+
+// Clients' buckets indexed by address, which only exist while they have transfers under way:
+static struct ratebucket *buckets[BUCKETS];
+
+// Guards the table above, though not the buckets' contents:
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool spend(struct ratebucket *, size_t, long long);
+
+// Sets the caps.
+// Accepts: bytes per second for the whole server, and for each client, either of which may be 0 for no limit
+void rateinit(uint64_t all, uint64_t per)
+{
+	total.rate = all;
+	each = per;
+}
+
+// Finds the bucket for a client, creating it if its first transfer is just starting.
+// Accepts: the client's address
+// Returns: a reference to be released with rateput(), or NULL if clients aren't capped individually
+struct ratebucket *rateget(const struct in_addr *addr)
+{
+	if(!each)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	struct ratebucket **head = buckets+ntohl(addr->s_addr)*0x9e3779b1u%BUCKETS;
+	struct ratebucket *b;
+	for(b = *head; b && b->addr != addr->s_addr; b = b->hnext);
+	if(!b && (b = calloc(1, sizeof *b)))
+	{
+		b->rate = each;
+		b->addr = addr->s_addr;
+		b->hnext = *head;
+		*head = b;
+	}
+	if(b)
+		++b->refs;
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+// Releases a reference to a client's bucket, discarding it if that was the client's last transfer.
+// Accepts: the bucket, or NULL
+void rateput(struct ratebucket *b)
+{
+	if(!b)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if(!--b->refs)
+	{
+		struct ratebucket **link;
+		for(link = buckets+ntohl(b->addr)*0x9e3779b1u%BUCKETS; *link != b; link = &(*link)->hnext);
+		*link = b->hnext;
+		free(b);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+// Spends bandwidth from both the client's bucket and the server's, so long as neither is already in debt.  Letting a datagram overdraw them means any size can be sent without their having to save up for it.  Each thread borrows from the server's bucket a tick's worth at a time, so that its transfers seldom touch what all the others share.
+// Accepts: the client's bucket or NULL, the bytes to send
+// Returns: 1 if they were granted, 0 if the client has run out for now, or -1 if the whole server has
+int ratetake(struct ratebucket *b, size_t bytes)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long now = ts.tv_sec*1000000000LL+ts.tv_nsec;
+
+	if(total.rate && credit <= 0)
+	{
+		size_t batch = total.rate*RATE_TICK_MS/1000;
+		if(batch < bytes)
+			batch = bytes;
+		if(!spend(&total, batch, now))
+			return -1;
+		credit += batch;
+	}
+	if(b && !spend(b, bytes, now))
+		return 0;
+	if(total.rate)
+		credit -= bytes;
+	return 1;
+}
+
+// Spends from a bucket, unless it's already in debt.  Whatever accrued beyond a short burst's worth is forfeited.
+// Accepts: the bucket, the bytes to spend, the current time in monotonic nanoseconds
+// Returns: whether they were granted
+bool spend(struct ratebucket *b, size_t bytes, long long now)
+{
+	long long cost = (double)bytes*1000000000/b->rate;
+	long long full = now-BURST_MS*1000000LL;
+	long long due = __atomic_load_n(&b->due, __ATOMIC_RELAXED);
+	long long from;
+	do
+	{
+		from = due > full ? due : full;
+		if(from >= now)
+			return 0;
+	}
+	while(!__atomic_compare_exchange_n(&b->due, &due, from+cost, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
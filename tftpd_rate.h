@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bandwidth caps shared by all of the server's transfers, as token buckets for the server as a whole and for each client.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#ifndef TFTPD_RATE_H
+#define TFTPD_RATE_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Most time to go between topping up transfers waiting for bandwidth, in milliseconds:
+extern const int RATE_TICK_MS;
+
+struct ratebucket;
+
+void rateinit(uint64_t, uint64_t);
+struct ratebucket *rateget(const struct in_addr *);
+void rateput(struct ratebucket *);
+int ratetake(struct ratebucket *, size_t);
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2013 Sol Boucher
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Impairment proxy, which relays TFTP between clients and a server while delaying, jittering, dropping, duplicating, and reordering datagrams.
+// Author: Sol Boucher <slb1566@rit.edu>
+
+#include "tftp_xfer.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+// One of our sockets, each of which relays everything it receives through a partner:
+struct port
+{
+	int fd;
+	struct flow *flow; // Client on whose behalf it exists
+	struct sockaddr_in tid; // Mirror: server transfer ID that it stands in for
+	struct port *next;
+};
+
+// Everything relayed for one client address:
+struct flow
+{
+	struct sockaddr_in client;
+	struct port up; // Faces the server, which sees it as the client
+	struct port *mirrors; // Face the client, which sees each as one of the server's transfer IDs
+	long long active; // When it last relayed anything, in monotonic milliseconds
+	struct flow *next;
+};
+
+// A datagram being held back until it's due:
+struct pending
+{
+	long long due; // In monotonic microseconds
+	unsigned long long serial; // Arrival order, which breaks ties
+	int fd; // Socket to send it from
+	struct sockaddr_in dest;
+	size_t len;
+	uint8_t *data;
+};
+
+// What's become of the datagrams traveling one way:
+struct fate
+{
+	unsigned long long relayed;
+	unsigned long long dropped;
+	unsigned long long duplicated;
+	unsigned long long reordered;
+};
+
+// Directions of travel:
+enum
+{
+	TO_SERVER,
+	TO_CLIENT,
+};
+
+// Most readiness notifications to handle per wakeup:
+#define EVENTS_MAX 64
+
+// How long a client may be silent before we forget it, which must exceed the longest a datagram can be held, reordering included:
+static const long long FLOW_IDLE_MS = 60000;
+
+// How much longer than usual a reordered datagram is held, at minimum:
+static const long long REORDER_MIN_US = 10000;
+
+// Impairments to apply in each direction:
+static long long delay; // In microseconds
+static long long jitter; // Largest deviation from the delay, in microseconds
+static double loss; // Probabilities
+static double dupe;
+static double reorder;
+
+// Whether to strip the options from requests, so that the server answers as one that predates them would:
+static bool plain;
+
+// State of the pseudorandom number generator:
+static uint64_t seed;
+
+// Where to relay requests:
+static struct sockaddr_in server;
+
+static int epfd;
+static struct flow *flows;
+static struct fate fates[2];
+
+// Datagrams awaiting transmission, as a binary heap ordered by when they're due:
+static struct pending *heap;
+static size_t queued;
+static size_t room;
+static unsigned long long serial;
+
+static void request(const void *, size_t, const struct sockaddr_in *);
+static void relay(struct port *, const void *, size_t, const struct sockaddr_in *);
+static void impair(int, int, const void *, size_t, const struct sockaddr_in *);
+static void hold(long long, int, const void *, size_t, const struct sockaddr_in *);
+static void release(void);
+static void expire(void);
+static void watch(struct port *);
+static struct port *mirror(struct flow *, const struct sockaddr_in *);
+static double chance(void);
+static bool earlier(const struct pending *, const struct pending *);
+static bool sameaddr(const struct sockaddr_in *, const struct sockaddr_in *);
+
+// Relays datagrams until interrupted, then summarizes what it did to them.
+// Accepts: command-line arguments
+// Returns: exit status
+int main(int argc, char **argv)
+{
+	// Parse command-line flags:
+	in_port_t listenport = PORT_UNPRIVILEGED+1;
+	seed = 1;
+	int flag;
+	while((flag = getopt(argc, argv, "l:d:j:L:D:R:S:O")) != -1)
+	{
+		if(flag == 'l')
+			listenport = atoi(optarg);
+		else if(flag == 'd')
+			delay = atof(optarg)*1000;
+		else if(flag == 'j')
+			jitter = atof(optarg)*1000;
+		else if(flag == 'L')
+			loss = atof(optarg)/100;
+		else if(flag == 'D')
+			dupe = atof(optarg)/100;
+		else if(flag == 'R')
+			reorder = atof(optarg)/100;
+		else if(flag == 'S')
+			seed = strtoull(optarg, NULL, 0);
+		else if(flag == 'O')
+			plain = 1;
+		else
+			optind = argc+1;
+	}
+	if(optind >= argc || argc-optind > 2 || delay < 0 || jitter < 0 || delay+3*jitter+REORDER_MIN_US >= FLOW_IDLE_MS*1000)
+	{
+		fprintf(stderr, "USAGE: %s [-l listen port] [-d delay ms] [-j jitter ms] [-L percent lost] [-D percent duplicated] [-R percent reordered] [-S seed] [-O] <hostname> [port]\n", argv[0]);
+		return 1;
+	}
+	if(!seed)
+		seed = 1;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	char port[6];
+	snprintf(port, sizeof port, "%hu", PORT_UNPRIVILEGED);
+	struct addrinfo *found;
+	if(getaddrinfo(argv[optind], argc-optind > 1 ? argv[optind+1] : port, &hints, &found))
+	{
+		fprintf(stderr, "%s: unable to resolve %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+	server = *(struct sockaddr_in *)found->ai_addr;
+	freeaddrinfo(found);
+
+	int listenfd = openudp(listenport);
+	if(listenfd < 0)
+		handle_error("bind()");
+	fcntl(listenfd, F_SETFL, O_NONBLOCK);
+
+	// Summarize upon being told to stop:
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	int sigfd = signalfd(-1, &sigs, 0);
+	if(sigfd < 0)
+		handle_error("signalfd()");
+
+	// Requests arrive on the listening socket, and everything else on one belonging to a flow:
+	struct port listener = {listenfd};
+	struct port signaler = {sigfd};
+	if((epfd = epoll_create1(0)) < 0)
+		handle_error("epoll_create1()");
+	watch(&listener);
+	watch(&signaler);
+
+	struct pktbatch inbox;
+	if(!batchinit(&inbox, BATCH_MAX))
+		handle_error("batchinit()");
+	struct epoll_event events[EVENTS_MAX];
+	bool running = 1;
+	while(running)
+	{
+		// Sleep until something arrives or the next held datagram falls due:
+		int timeout = -1;
+		if(queued)
+		{
+			long long left = heap[0].due-xfermicros();
+			timeout = left > 0 ? (left+999)/1000 : 0;
+		}
+		int nevents = epoll_wait(epfd, events, EVENTS_MAX, timeout);
+
+		pktcork();
+		int index;
+		for(index = 0; index < nevents; ++index)
+		{
+			struct port *p = events[index].data.ptr;
+			if(p == &signaler)
+			{
+				running = 0;
+				continue;
+			}
+
+			unsigned count;
+			do
+			{
+				count = recvbatch(p->fd, &inbox, inbox.cap);
+				unsigned each;
+				for(each = 0; each < count; ++each)
+				{
+					if(p == &listener)
+						request(batchbuf(&inbox, each), batchlen(&inbox, each), batchaddr(&inbox, each));
+					else
+						relay(p, batchbuf(&inbox, each), batchlen(&inbox, each), batchaddr(&inbox, each));
+				}
+			}
+			while(count == inbox.cap);
+		}
+		release();
+		pktuncork();
+		expire();
+	}
+
+	static const char *const DIRECTIONS[] = {"to_server", "to_client"};
+	fprintf(stderr, "{");
+	int index;
+	for(index = 0; index < 2; ++index)
+		fprintf(stderr, "%s\"%s\":{\"relayed\":%llu,\"dropped\":%llu,\"duplicated\":%llu,\"reordered\":%llu}", index ? "," : "",
+				DIRECTIONS[index], fates[index].relayed, fates[index].dropped, fates[index].duplicated, fates[index].reordered);
+	fprintf(stderr, "}\n");
+	return 0;
+}
+
+// Forwards a request to the server from a socket dedicated to the client that sent it, so that the server's replies find their way back.
+// Accepts: the request packet, its length, its source address
+void request(const void *pkt, size_t len, const struct sockaddr_in *from)
+{
+	struct flow *f;
+	for(f = flows; f && !sameaddr(&f->client, from); f = f->next);
+	if(!f)
+	{
+		int upfd = openudp(0);
+		if(upfd < 0)
+			return;
+		fcntl(upfd, F_SETFL, O_NONBLOCK);
+
+		f = calloc(1, sizeof *f);
+		f->client = *from;
+		f->up.fd = upfd;
+		f->up.flow = f;
+		f->next = flows;
+		flows = f;
+		watch(&f->up);
+	}
+
+	// Cut off whatever follows the filename and mode:
+	if(plain)
+	{
+		const char *end = len > 2 ? memchr((const char *)pkt+2, '\0', len-2) : NULL;
+		if(end)
+			end = memchr(end+1, '\0', (const char *)pkt+len-end-1);
+		if(end)
+			len = end+1-(const char *)pkt;
+	}
+
+	f->active = xferclock();
+	impair(TO_SERVER, f->up.fd, pkt, len, &server);
+}
+
+// Forwards a datagram that arrived on one of a flow's sockets to the other side.
+// Accepts: the socket it arrived on, the packet, its length, its source address
+void relay(struct port *p, const void *pkt, size_t len, const struct sockaddr_in *from)
+{
+	struct flow *f = p->flow;
+	if(p == &f->up)
+	{
+		// The client must hear each of the server's transfer IDs as a distinct port of ours:
+		struct port *m = mirror(f, from);
+		if(m)
+			impair(TO_CLIENT, m->fd, pkt, len, &f->client);
+	}
+	else if(sameaddr(from, &f->client))
+		impair(TO_SERVER, f->up.fd, pkt, len, &p->tid);
+	else
+		return;
+	f->active = xferclock();
+}
+
+// Subjects a datagram to loss, duplication, delay, jitter, and reordering on its way somewhere.
+// Accepts: its direction, the socket to send it from, the packet, its length, its destination
+void impair(int dir, int sfd, const void *pkt, size_t len, const struct sockaddr_in *dest)
+{
+	if(chance() < loss)
+	{
+		++fates[dir].dropped;
+		return;
+	}
+
+	unsigned copies = 1;
+	if(chance() < dupe)
+	{
+		++fates[dir].duplicated;
+		++copies;
+	}
+
+	long long now = xfermicros();
+	while(copies--)
+	{
+		long long when = now+delay;
+		if(jitter)
+			when += (long long)((2*chance()-1)*jitter);
+
+		// Hold this one back long enough for those behind it to overtake it:
+		if(chance() < reorder)
+		{
+			++fates[dir].reordered;
+			when += 2*jitter > REORDER_MIN_US ? 2*jitter : REORDER_MIN_US;
+		}
+
+		hold(when < now ? now : when, sfd, pkt, len, dest);
+	}
+	++fates[dir].relayed;
+}
+
+// Queues a datagram to be sent later.
+// Accepts: when it's due in monotonic microseconds, the socket to send it from, the packet, its length, its destination
+void hold(long long due, int sfd, const void *pkt, size_t len, const struct sockaddr_in *dest)
+{
+	if(queued == room)
+	{
+		room = room ? 2*room : 256;
+		heap = realloc(heap, room*sizeof *heap);
+	}
+
+	struct pending item = {due, serial++, sfd, *dest, len, malloc(len)};
+	memcpy(item.data, pkt, len);
+
+	// Sift it up into place:
+	size_t index = queued++;
+	while(index && earlier(&item, heap+(index-1)/2))
+	{
+		heap[index] = heap[(index-1)/2];
+		index = (index-1)/2;
+	}
+	heap[index] = item;
+}
+
+// Sends every held datagram that has fallen due.
+void release(void)
+{
+	long long now = xfermicros();
+	while(queued && heap[0].due <= now)
+	{
+		struct pending item = heap[0];
+		void *pkt = pktslot(item.fd, &item.dest);
+		if(pkt)
+		{
+			memcpy(pkt, item.data, item.len);
+			pktcommit(item.len);
+		}
+		free(item.data);
+
+		// Sift the last item down into the vacancy:
+		struct pending last = heap[--queued];
+		size_t index = 0;
+		while(2*index+1 < queued)
+		{
+			size_t child = 2*index+1;
+			if(child+1 < queued && earlier(heap+child+1, heap+child))
+				++child;
+			if(!earlier(heap+child, &last))
+				break;
+			heap[index] = heap[child];
+			index = child;
+		}
+		heap[index] = last;
+	}
+}
+
+// Forgets every client that has gone quiet, along with its sockets.
+void expire(void)
+{
+	long long now = xferclock();
+	struct flow **link = &flows;
+	while(*link)
+	{
+		struct flow *f = *link;
+		if(now-f->active < FLOW_IDLE_MS)
+		{
+			link = &f->next;
+			continue;
+		}
+
+		*link = f->next;
+		while(f->mirrors)
+		{
+			struct port *m = f->mirrors;
+			f->mirrors = m->next;
+			close(m->fd);
+			free(m);
+		}
+		close(f->up.fd);
+		free(f);
+	}
+}
+
+// Adds one of our sockets to the event loop.
+// Accepts: the socket
+void watch(struct port *p)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = p;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev))
+		handle_error("epoll_ctl()");
+}
+
+// Finds or opens the socket that stands in for one of the server's transfer IDs.
+// Accepts: the flow, the transfer ID
+// Returns: the socket, or NULL if none could be opened
+struct port *mirror(struct flow *f, const struct sockaddr_in *tid)
+{
+	struct port *m;
+	for(m = f->mirrors; m && !sameaddr(&m->tid, tid); m = m->next);
+	if(m)
+		return m;
+
+	int sfd = openudp(0);
+	if(sfd < 0)
+		return NULL;
+	fcntl(sfd, F_SETFL, O_NONBLOCK);
+
+	m = calloc(1, sizeof *m);
+	m->fd = sfd;
+	m->flow = f;
+	m->tid = *tid;
+	m->next = f->mirrors;
+	f->mirrors = m;
+	watch(m);
+	return m;
+}
+
+// Draws a pseudorandom number using xorshift64*, so that a given seed always yields the same impairments.
+// Returns: a value in [0, 1)
+double chance(void)
+{
+	seed ^= seed>>12;
+	seed ^= seed<<25;
+	seed ^= seed>>27;
+	return (seed*2685821657736338717ULL>>11)*(1.0/(1ULL<<53));
+}
+
+// Orders held datagrams by when they're due, then by when they arrived.
+// Accepts: two of them
+// Returns: whether the first goes out before the second
+bool earlier(const struct pending *a, const struct pending *b)
+{
+	return a->due < b->due || (a->due == b->due && a->serial < b->serial);
+}
+
+// Compares two socket addresses.
+// Accepts: the addresses
+// Returns: whether they have the same IP address and port
+bool sameaddr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}